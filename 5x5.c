@@ -33,14 +33,23 @@
 #include "elog.h"
 #include "flash.h"
 #include "keyboard.h"
+#include "keymap.h"
+#include "leader.h"
 #include "led.h"
 #include "macro.h"
 #include "matrix.h"
 #include "mouse.h"
+#include "profile.h"
+#include "queue.h"
 #include "serial.h"
 #include "usb.h"
 
-static bool enumeration_active;
+#define ENUMERATION_HID     ((1 << IF_KEYBOARD) | (1 << IF_MOUSE) | \
+                             (1 << IF_EXTRAKEY) | (1 << IF_NKRO))
+#define ENUMERATION_ALL     (ENUMERATION_HID | (1 << IF_SERIALCOMM))
+
+static volatile bool enumeration_active;
+static volatile uint32_t enumeration_timer;
 
 static void
 mcu_init(void)
@@ -55,6 +64,10 @@ void
 usb_reset(void)
 {
     elog("usb reset");
+    usb_ifs_enumerated = 0;
+    keyboard_active = false;
+    serial_active = false;
+    enumeration_timer = timer_set(MS_ENUMERATE);
     enumeration_active = true;
 }
 
@@ -70,11 +83,42 @@ usb_suspend(void)
     elog("usb suspend");
 }
 
+/*
+ * enumeration_run
+ *
+ * Follow the enumeration by the host without holding up the main loop.
+ * Note that this is the start state, but renewing enumeration can also be
+ * requested by the host at any time using an usb reset.
+ *
+ * Keys are scanned as soon as the host read the report descriptor of one
+ * of the hid interfaces; usb holds the reports of the others until theirs
+ * is read. Our serial comms could require a driver, so it comes up
+ * whenever the host opens it, if ever. Only when nothing enumerates in
+ * MS_ENUMERATE do we start over.
+ */
+static void
+enumeration_run(void)
+{
+    uint32_t ifs = usb_ifs_enumerated;
+
+    if (ifs & ENUMERATION_HID) {
+        keyboard_active = true;
+    }
+    if (ifs & (1 << IF_SERIALCOMM)) {
+        serial_active = true;
+    }
+
+    if (ifs == ENUMERATION_ALL) {
+        enumeration_active = false;
+    } else if (!ifs && timer_passed(enumeration_timer)) {
+        elog("enumeration failed");
+        scb_reset_system();
+    }
+}
+
 int
 main(void)
 {
-    uint32_t enumeration_timer;
-
     mcu_init();
 
     usb_prevent_enumeration();
@@ -83,52 +127,36 @@ main(void)
     crc_init();
     serial_init();
     led_init();
+    keymap_reset();
+    leader_clear();
+    queue_init();
+    PROFILE_INIT();
     matrix_init();
     macro_init();
-    usb_init();
     flash_read_config();
+    usb_init();
 
     elog("initialized");
 
+    enumeration_timer = timer_set(MS_ENUMERATE);
     enumeration_active = true;
 
     while (1) {
+        PROFILE_LOOP();
+
         if (enumeration_active) {
-            /*
-             * Note that this is the start state, but renewing
-             * enumeration can also be requested by the host at any
-             * time using an usb reset.
-             *
-             * This phase can complete partially. Keyboard and mouse
-             * are standard, but our serial comms could require a
-             * driver and not be enumerated succesfully.
-             */
-            usb_ifs_enumerated = 0;
-            enumeration_timer = timer_set(MS_ENUMERATE);
-            while ((usb_ifs_enumerated != ((1 << IF_KEYBOARD) |
-                                           (1 << IF_MOUSE)    |
-                                           (1 << IF_EXTRAKEY) |
-                                           (1 << IF_NKRO)     |
-                                           (1 << IF_SERIALCOMM))) &&
-                   (!timer_passed(enumeration_timer))) {
-                __asm__("nop");
-            }
-
-            if (!usb_ifs_enumerated) {
-                elog("enumeration failed");
-                scb_reset_system();
-            }
-
-            enumeration_active = false;
-            keyboard_active = serial_active = true;
+            enumeration_run();
         }
 
         if (serial_active) {
             serial_out();
         }
 
+        usb_reconnect_run();
+
         if (keyboard_active) {
             matrix_process();
+            keymap_process();
         }
 
         if (automouse_active) {
@@ -137,6 +165,8 @@ main(void)
 
         if (macro_active) {
             macro_run();
+        } else if (!automouse_active) {
+            matrix_sleep();
         }
     }
 }
@@ -60,6 +60,25 @@ clock_now(void)
     return system_ms;
 }
 
+/*
+ * clock_now_us
+ *
+ * Microseconds since start, from the millisecond count and the systick
+ * counter. Wraps after about 71 minutes.
+ */
+uint32_t
+clock_now_us(void)
+{
+    uint32_t ms, ticks;
+
+    do {
+        ms = system_ms;
+        ticks = STK_RVR - STK_CVR;
+    } while (ms != system_ms);
+
+    return (ms * 1000) + (ticks / (rcc_ahb_frequency / 1000000));
+}
+
 uint32_t
 timer_set(uint32_t delay)
 {
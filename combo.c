@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * combo
+ *
+ * Recognise combos in the key events from the matrix. Presses of keys that
+ * are part of a combo are held back until they either complete a combo or
+ * cannot anymore; at most MS_COMBO_TERM. Everything else is passed on to
+ * the keymap unchanged. A combo that fires is passed on as a key event of
+ * its first key that carries the combo number, so it goes through the same
+ * tap-hold, tap-dance, leader and one-shot handling as any key.
+ *
+ * combo_index holds, per key, a bit for every combo that contains the key.
+ * The candidates for the keys held back are the AND of their index entries,
+ * so only combos that can still match are ever compared against the keys.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "combo.h"
+#include "config.h"
+#include "deadline.h"
+#include "elog.h"
+#include "keymap.h"
+#include "matrix.h"
+#include "queue.h"
+#include "serial.h"
+
+#if COMBO_NUM > 32
+#error COMBO_NUM must fit in a combo bitmask
+#endif
+
+combo_t combos[COMBO_NUM];
+
+static uint32_t combo_index[MATRIX_WORDS * 32];
+static uint32_t combo_defined;
+
+/* presses held back, and the combos they can still become */
+static keyevent_t combo_buffer[COMBO_MAXKEYS];
+static uint8_t combo_len;
+static matrix_t combo_pending;
+static uint32_t combo_candidates;
+
+/* combos that fired, and their keys that are still down */
+static uint32_t combo_active;
+static matrix_t combo_held;
+static event_t combo_latched[COMBO_NUM];
+static keyevent_t combo_key[COMBO_NUM];
+
+/*
+ * combo_init
+ *
+ * Index the combo table, i.e. after it has been read from flash
+ */
+void
+combo_init(void)
+{
+    uint32_t todo;
+    uint16_t k;
+    uint8_t i, w;
+
+    memset(combo_index, 0, sizeof(combo_index));
+    combo_defined = 0;
+
+    for (i = 0; i < COMBO_NUM; i++) {
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            todo = combos[i].keys.word[w];
+            while (todo) {
+                k = __builtin_ctz(todo);
+                todo &= ~(1U << k);
+                combo_index[(w * 32) + k] |= (1U << i);
+                combo_defined |= (1U << i);
+            }
+        }
+    }
+}
+
+/*
+ * combo_match
+ *
+ * Return the candidates that consist of exactly the keys held back
+ */
+static uint32_t
+combo_match(void)
+{
+    uint32_t todo = combo_candidates;
+    uint32_t match = 0;
+    uint8_t i;
+
+    while (todo) {
+        i = __builtin_ctz(todo);
+        todo &= ~(1U << i);
+        if (!memcmp(&combos[i].keys, &combo_pending, sizeof(matrix_t))) {
+            match |= (1U << i);
+        }
+    }
+
+    return match;
+}
+
+/*
+ * combo_clear
+ *
+ * Forget the presses held back
+ */
+static void
+combo_clear(void)
+{
+    combo_len = 0;
+    combo_candidates = 0;
+    memset(&combo_pending, 0, sizeof(combo_pending));
+    deadline_cancel(DEADLINE_COMBO);
+}
+
+/*
+ * combo_resolve
+ *
+ * Fire the combo formed by the presses held back, or pass the presses on
+ * if they do not form one.
+ */
+static void
+combo_resolve(void)
+{
+    keyevent_t replay[COMBO_MAXKEYS];
+    uint32_t match = combo_match();
+    uint8_t i, w, len = combo_len;
+
+    if (match) {
+        i = __builtin_ctz(match);
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            combo_held.word[w] |= combo_pending.word[w];
+        }
+        combo_key[i] = combo_buffer[0];
+        combo_key[i].combo = i + 1;
+        combo_key[i].timestamp_us = combo_buffer[len - 1].timestamp_us;
+        combo_clear();
+        combo_active |= (1U << i);
+        combo_latched[i] = combos[i].event;
+        keymap_key(&combo_key[i]);
+        return;
+    }
+
+    memcpy(replay, combo_buffer, len * sizeof(keyevent_t));
+    combo_clear();
+    for (i = 0; i < len; i++) {
+        keymap_key(&replay[i]);
+    }
+}
+
+/*
+ * combo_expire
+ *
+ * The combo term of the first press held back passed
+ */
+static void
+combo_expire(uint32_t at_us)
+{
+    (void)at_us;
+
+    if (combo_len) {
+        combo_resolve();
+    }
+}
+
+/*
+ * combo_release
+ *
+ * Release the combos that contain a key, and swallow the releases of the
+ * other keys of those combos.
+ */
+static bool
+combo_release(const keyevent_t *key)
+{
+    uint16_t k = MATRIX_BIT(key->row, key->col);
+    uint32_t bit = (1U << (k % 32));
+    uint32_t todo;
+    uint8_t i;
+
+    if (!(combo_held.word[k / 32] & bit)) {
+        return false;
+    }
+
+    combo_held.word[k / 32] &= ~bit;
+    todo = combo_active & combo_index[k];
+    while (todo) {
+        i = __builtin_ctz(todo);
+        todo &= ~(1U << i);
+        combo_active &= ~(1U << i);
+        combo_key[i].pressed = false;
+        combo_key[i].timestamp_us = key->timestamp_us;
+        keymap_key(&combo_key[i]);
+    }
+
+    return true;
+}
+
+/*
+ * combo_event
+ *
+ * Take on a key event from the matrix
+ */
+void
+combo_event(const keyevent_t *key)
+{
+    uint16_t k = MATRIX_BIT(key->row, key->col);
+    uint32_t candidates;
+    uint32_t match;
+
+    if (combo_len && ((int32_t)(key->timestamp_us - combo_buffer[0].timestamp_us) >=
+                      (MS_COMBO_TERM * 1000))) {
+        /* the combo term passed before this event */
+        combo_resolve();
+    }
+
+    if (!key->pressed) {
+        if (combo_len) {
+            combo_resolve();
+        }
+        if (!combo_release(key)) {
+            keymap_key(key);
+        }
+        return;
+    }
+
+    candidates = combo_index[k] & combo_defined;
+
+    if (combo_len && (!(combo_candidates & candidates) || (combo_len >= COMBO_MAXKEYS))) {
+        /* this key cannot be part of what is held back */
+        combo_resolve();
+    }
+
+    if (!combo_len && candidates) {
+        combo_candidates = candidates;
+        deadline_set(DEADLINE_COMBO, key->timestamp_us + (MS_COMBO_TERM * 1000), combo_expire);
+    } else if (combo_len) {
+        combo_candidates &= candidates;
+    } else {
+        keymap_key(key);
+        return;
+    }
+
+    combo_buffer[combo_len++] = *key;
+    combo_pending.word[k / 32] |= (1U << (k % 32));
+
+    /* fire at once if no larger combo can follow */
+    match = combo_match();
+    if (match && !(combo_candidates & ~match)) {
+        combo_resolve();
+    }
+}
+
+/*
+ * combo_action
+ *
+ * Return the event of a combo as it was when the combo fired
+ */
+const event_t *
+combo_action(uint8_t number)
+{
+    return &combo_latched[number];
+}
+
+/*
+ * combo_set
+ *
+ * Define a combo; a combo without keys is removed
+ */
+void
+combo_set(uint8_t number, const matrix_t *keys, event_t *event)
+{
+    uint8_t w, n = 0;
+
+    if (number >= COMBO_NUM) {
+        elog("combo number out of bounds");
+        return;
+    }
+
+    for (w = 0; w < MATRIX_WORDS; w++) {
+        n += __builtin_popcount(keys->word[w]);
+    }
+    if ((n == 1) || (n > COMBO_MAXKEYS)) {
+        elog("combo needs 2 to %d keys", COMBO_MAXKEYS);
+        return;
+    }
+
+    combos[number].keys = *keys;
+    combos[number].event = *event;
+    combo_init();
+}
+
+/*
+ * combo_dump
+ *
+ * Emit every defined combo, as its keys and its event
+ */
+void
+combo_dump(void)
+{
+    uint32_t todo;
+    uint16_t k;
+    uint8_t i, w;
+
+    for (i = 0; i < COMBO_NUM; i++) {
+        if (!(combo_defined & (1U << i))) {
+            continue;
+        }
+        printf("combo %02x: ", i);
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            todo = combos[i].keys.word[w];
+            while (todo) {
+                k = __builtin_ctz(todo);
+                todo &= ~(1U << k);
+                k += w * 32;
+                printf("%02x%02x ", MATRIX_ROW(k), MATRIX_COL(k));
+            }
+        }
+        printf("-> %01x,%02x%02x%02x\n\r",
+               combos[i].event.type,
+               combos[i].event.args.num1,
+               combos[i].event.args.num2,
+               combos[i].event.args.num3);
+    }
+}
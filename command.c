@@ -25,14 +25,22 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+
+#include "combo.h"
 #include "command.h"
 #include "config.h"
 #include "elog.h"
 #include "keyboard.h"
 #include "keymap.h"
+#include "leader.h"
 #include "macro.h"
+#include "matrix.h"
+#include "override.h"
+#include "profile.h"
 #include "ring.h"
 #include "serial.h"
+#include "tapdance.h"
 #include "usb.h"
 #include "flash.h"
 
@@ -96,6 +104,120 @@ command_set_keymap(struct ring *input_ring)
     keymap_set(alayer, arow, acolumn, &event);
 }
 
+static void
+command_set_combo(struct ring *input_ring)
+{
+    uint8_t number, count, arow, acolumn;
+    uint16_t k;
+    matrix_t keys;
+    event_t event;
+    bool valid = true;
+
+    memset(&keys, 0, sizeof(keys));
+
+    /* read all arguments, so none are left to be taken for a command */
+    number = read_hex_8(input_ring);
+    count = read_hex_8(input_ring);
+    while (count--) {
+        arow = read_hex_8(input_ring);
+        acolumn = read_hex_8(input_ring);
+        if ((arow >= ROWS_NUM) || (acolumn >= COLS_NUM)) {
+            valid = false;
+            continue;
+        }
+        k = MATRIX_BIT(arow, acolumn);
+        keys.word[k / 32] |= (1U << (k % 32));
+    }
+
+    event.type = read_hex_8(input_ring);
+    event.args.num1 = read_hex_8(input_ring);
+    event.args.num2 = read_hex_8(input_ring);
+    event.args.num3 = read_hex_8(input_ring);
+
+    if (!valid) {
+        elog("combo key out of bounds");
+        return;
+    }
+
+    combo_set(number, &keys, &event);
+}
+
+static void
+command_set_leader(struct ring *input_ring)
+{
+    uint16_t keys[LEADER_MAXLEN];
+    uint8_t count, arow, acolumn, i;
+    event_t event;
+    bool valid = true;
+
+    count = read_hex_8(input_ring);
+    if (!count) {
+        leader_clear();
+        return;
+    }
+
+    /* read all arguments, so none are left to be taken for a command */
+    for (i = 0; i < count; i++) {
+        arow = read_hex_8(input_ring);
+        acolumn = read_hex_8(input_ring);
+        if ((arow >= ROWS_NUM) || (acolumn >= COLS_NUM)) {
+            valid = false;
+        } else if (i < LEADER_MAXLEN) {
+            keys[i] = (arow * COLS_NUM) + acolumn;
+        }
+    }
+
+    event.type = read_hex_8(input_ring);
+    event.args.num1 = read_hex_8(input_ring);
+    event.args.num2 = read_hex_8(input_ring);
+    event.args.num3 = read_hex_8(input_ring);
+
+    if (count > LEADER_MAXLEN) {
+        elog("leader sequence too long");
+        return;
+    }
+    if (!valid) {
+        elog("leader key out of bounds");
+        return;
+    }
+
+    leader_add(keys, count, &event);
+}
+
+static void
+command_set_override(struct ring *input_ring)
+{
+    override_t override;
+    uint8_t number;
+
+    number = read_hex_8(input_ring);
+    override.key = read_hex_8(input_ring);
+    override.trigger = read_hex_8(input_ring);
+    override.suppress = read_hex_8(input_ring);
+    override.event.type = read_hex_8(input_ring);
+    override.event.args.num1 = read_hex_8(input_ring);
+    override.event.args.num2 = read_hex_8(input_ring);
+    override.event.args.num3 = read_hex_8(input_ring);
+
+    override_set(number, &override);
+}
+
+static void
+command_set_tapdance(struct ring *input_ring)
+{
+    uint8_t number, tap;
+    event_t event;
+
+    number = read_hex_8(input_ring);
+    tap = read_hex_8(input_ring);
+    event.type = read_hex_8(input_ring);
+    event.args.num1 = read_hex_8(input_ring);
+    event.args.num2 = read_hex_8(input_ring);
+    event.args.num3 = read_hex_8(input_ring);
+
+    tapdance_set(number, tap, &event);
+}
+
 static void
 command_set_macro(struct ring *input_ring)
 {
@@ -134,6 +256,23 @@ command_process(struct ring *input_ring)
 
     while (ring_read_ch(input_ring, &c) != -1) {
         switch (c) {
+            case CMD_COMBO_DUMP:
+                combo_dump();
+                break;
+
+            case CMD_COMBO_SET:
+                command_set_combo(input_ring);
+                break;
+
+            case CMD_DEBOUNCE_DUMP:
+                matrix_dump_debounce();
+                break;
+
+            case CMD_DEBOUNCE_SET:
+                matrix_set_debounce(read_hex_8(input_ring));
+                printfnl("debounce %d", debounce_mode);
+                break;
+
             case CMD_FLASH_CLEAR:
                 flash_clear_config();
                 break;
@@ -158,6 +297,14 @@ command_process(struct ring *input_ring)
                 command_set_keymap(input_ring);
                 break;
 
+            case CMD_LEADER_DUMP:
+                leader_dump();
+                break;
+
+            case CMD_LEADER_SET:
+                command_set_leader(input_ring);
+                break;
+
             case CMD_MACRO_CLEAR:
                 macro_init();
                 break;
@@ -166,6 +313,11 @@ command_process(struct ring *input_ring)
                 command_set_macro(input_ring);
                 break;
 
+            case CMD_MATRIX_STATS:
+                matrix_stats();
+                usb_stats();
+                break;
+
             case CMD_NKRO_CLEAR:
                 nkro_active = 0;
                 printfnl("nkro %d", nkro_active);
@@ -176,16 +328,63 @@ command_process(struct ring *input_ring)
                 printfnl("nkro %d", nkro_active);
                 break;
 
+            case CMD_OVERRIDE_DUMP:
+                override_dump();
+                break;
+
+            case CMD_OVERRIDE_SET:
+                command_set_override(input_ring);
+                break;
+
+#if PROFILE
+            case CMD_PROFILE:
+                profile_dump();
+                break;
+#endif
+
+            case CMD_TAPDANCE_DUMP:
+                tapdance_dump();
+                break;
+
+            case CMD_TAPDANCE_SET:
+                command_set_tapdance(input_ring);
+                break;
+
+            case CMD_USB_POLL_DUMP:
+                usb_poll_dump();
+                break;
+
+            case CMD_USB_POLL_SET:
+                usb_poll_set(read_hex_8(input_ring));
+                usb_poll_dump();
+                break;
+
             case '?':
                 printfnl("commands:");
+                printfnl("b                - dump debounce window per key");
+                printfnl("c                - dump combos");
+                printfnl("Cnnkk(rrcc)tta1a2a3 - set combo nn to kk keys, type, arg1-3");
+                printfnl("Dmm              - set debounce mode, 00 defer, 01 eager");
                 printfnl("i                - identify");
                 printfnl("k                - dump keymap");
                 printfnl("Kllrrcctta1a2a3  - set keymap layer, row, column, type, arg1-3");
+                printfnl("l                - dump leader sequences");
+                printfnl("Lkk(rrcc)tta1a2a3 - add leader sequence of kk keys, type, arg1-3");
                 printfnl("m                - clear all macro keys");
                 printfnl("Mnnstring        - set macro nn with string");
                 printfnl("n                - clear nkro");
                 printfnl("N                - set nkro");
+                printfnl("o                - dump key overrides");
+                printfnl("Onnkkttsstta1a2a3 - set override nn for key kk, trigger, suppress, type, arg1-3");
+#if PROFILE
+                printfnl("p                - show and reset scan profile");
+#endif
                 printfnl("R                - read configuration from flash");
+                printfnl("s                - show matrix and usb statistics");
+                printfnl("t                - dump tap-dance keys");
+                printfnl("Tnnxxtta1a2a3    - set tap-dance nn action for xx taps, type, arg1-3");
+                printfnl("u                - dump usb polling profiles");
+                printfnl("Unn              - select usb polling profile nn, reconnects usb");
                 printfnl("W                - write configuration to flash");
                 printfnl("Z                - erase configuration flash");
                 break;
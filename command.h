@@ -30,16 +30,30 @@
 
 #include "ring.h"
 
+#define CMD_COMBO_DUMP    'c'
+#define CMD_COMBO_SET     'C'
+#define CMD_DEBOUNCE_DUMP 'b'
+#define CMD_DEBOUNCE_SET  'D'
 #define CMD_FLASH_CLEAR   'Z'
 #define CMD_FLASH_READ    'R'
 #define CMD_FLASH_WRITE   'W'
 #define CMD_IDENTIFY      'i'
 #define CMD_KEYMAP_DUMP   'k'
 #define CMD_KEYMAP_SET    'K'
+#define CMD_LEADER_DUMP   'l'
+#define CMD_LEADER_SET    'L'
 #define CMD_MACRO_CLEAR   'm'
 #define CMD_MACRO_SET     'M'
+#define CMD_MATRIX_STATS  's'
 #define CMD_NKRO_CLEAR    'n'
 #define CMD_NKRO_SET      'N'
+#define CMD_OVERRIDE_DUMP 'o'
+#define CMD_OVERRIDE_SET  'O'
+#define CMD_PROFILE       'p'
+#define CMD_TAPDANCE_DUMP 't'
+#define CMD_TAPDANCE_SET  'T'
+#define CMD_USB_POLL_DUMP 'u'
+#define CMD_USB_POLL_SET  'U'
 
 void command_process(struct ring *input_ring);
 
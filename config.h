@@ -42,25 +42,131 @@
  * PA0-A4 = row driver
  * PB0-B2, B6-B7 = column reader
  *
- * COLS_DECODE is used after column GPIO reading to get a consecutive bitfield
+ * MATRIX_ROWS lists the row driver pins in row order as ROW(port, pin).
+ * MATRIX_COLS lists the column reader pins in column order, as runs of
+ * consecutive pins on one port: COLS(port, first pin, number of pins). Rows
+ * and columns can be spread over ports A, B and C, up to 16 rows and 32
+ * columns. ROWS_NUM and COLS_NUM must match the lists.
  */
 
 #define ROWS_NUM        5
-#define ROWS_GPIO       GPIOA
-#define ROWS_RCC        RCC_GPIOA
-#define ROWS_BV         0b11111
+#define MATRIX_ROWS(ROW)                                                \
+    ROW(GPIOA, 0) ROW(GPIOA, 1) ROW(GPIOA, 2) ROW(GPIOA, 3) ROW(GPIOA, 4)
 
 #define COLS_NUM        5
-#define COLS_GPIO       GPIOB
-#define COLS_RCC        RCC_GPIOB
-#define COLS_BV         0b11000111
-#define COLS_DECODE(x)  (((x >> 3) & 0b11000) | (x & 0b111))
+#define MATRIX_COLS(COLS)                                               \
+    COLS(GPIOB, 0, 3) COLS(GPIOB, 6, 2)
 
-#define LAYERS_NUM      5
+/*
+ * Matrix scan engine. With MATRIX_SCAN_DMA set, TIM2 and DMA1 channels 2
+ * and 5 scan the matrix at MATRIX_SCAN_HZ frames per second without cpu
+ * involvement; the main loop only debounces. Otherwise the main loop scans
+ * the matrix itself.
+ */
+#define MATRIX_SCAN_DMA 0
+#define MATRIX_SCAN_HZ  8000
+
+/*
+ * Measure the scan rate and main loop times, shown by the 'p' command.
+ * Costs a few cycles per scan and per loop; leave off for normal use.
+ */
+#define PROFILE         0
 
-#define MS_DEBOUNCE     10
+/*
+ * Layers in the keymap, at most 32. Only keys that are not transparent
+ * take one of the KEYMAP_CELLS cells, whatever layer they are on. The
+ * presence bitmaps and the cells together take no more than the 5 dense
+ * layers of 5x5 keys they replace.
+ */
+#define LAYERS_NUM      32
+#define KEYMAP_CELLS    92
+
+/*
+ * Debounce strategy, can be changed at runtime via serial:
+ * - DEBOUNCE_DEFER: report a key after it has been stable for its window
+ * - DEBOUNCE_EAGER: report a key at its first edge, then ignore it for its
+ *                   window
+ *
+ * Every key starts with a window of MS_DEBOUNCE. With DEBOUNCE_ADAPTIVE the
+ * window of each key follows the bounce time measured on that switch plus
+ * MS_DEBOUNCE_MARGIN, between MS_DEBOUNCE_MIN and MS_DEBOUNCE_MAX.
+ */
+#define DEBOUNCE_MODE       DEBOUNCE_DEFER
+#define DEBOUNCE_ADAPTIVE   1
+#define MS_DEBOUNCE         10
+#define MS_DEBOUNCE_MIN     2
+#define MS_DEBOUNCE_MAX     15
+#define MS_DEBOUNCE_MARGIN  2
 #define MS_ENUMERATE    5000
 
+/*
+ * Time to let the serial answer go out before reconnecting usb, and time
+ * to stay disconnected, after a change of the polling profile
+ */
+#define MS_RECONNECT    100
+
+/*
+ * Time without any key activity before the matrix stops scanning and waits
+ * for a column interrupt instead.
+ */
+#define MS_IDLE         2000
+
+/*
+ * Tap-hold keys held longer than this are a hold. Up to TAPHOLD_BUFFER key
+ * events can wait for a tap-hold key to be decided.
+ */
+#define MS_TAPPING_TERM 200
+#define TAPHOLD_BUFFER  16
+
+/*
+ * Combos: up to COMBO_NUM combos of up to COMBO_MAXKEYS keys each. The keys
+ * of a combo must all be pressed within MS_COMBO_TERM.
+ */
+#define COMBO_NUM       16
+#define COMBO_MAXKEYS   4
+#define MS_COMBO_TERM   50
+
+/*
+ * Leader key: sequences of up to LEADER_MAXLEN keys, stored in a trie of
+ * LEADER_NODES nodes. Every key of a sequence must follow within
+ * MS_LEADER_TIMEOUT. The trie is stored in flash; flash.h stops the build
+ * if the configuration no longer fits.
+ */
+#define LEADER_NODES        128
+#define LEADER_MAXLEN       8
+#define MS_LEADER_TIMEOUT   1000
+
+/*
+ * Tap-dance keys, each with an action for up to TAPDANCE_TAPS taps; taps
+ * count as long as each follows the previous one within the term.
+ */
+#define TAPDANCE_NUM        8
+#define TAPDANCE_TAPS       3
+#define MS_TAPDANCE_TERM    200
+
+/*
+ * Number of key overrides, must be a multiple of 4
+ */
+#define OVERRIDE_NUM        16
+
+/*
+ * One-shot modifiers and layers that are not used within this time are
+ * dropped.
+ */
+#define MS_ONESHOT_TIMEOUT  1000
+
+/*
+ * Number of key events that can wait between the matrix and the keymap,
+ * must be a power of two
+ */
+#define QUEUE_SIZE      32
+
+/*
+ * Number of HID reports that can wait for each endpoint, must be a power
+ * of two
+ */
+#define REPORT_FIFO_SIZE 8
+
 /*
  * Number of macro keys, and max len of a macro sequence
  */
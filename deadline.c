@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * deadline
+ *
+ * Fixed set of deadlines, one per user, in microseconds. Callers run the
+ * deadlines up to a point in time, usually the timestamp of the next key
+ * event or the current time, so nothing ever needs to wait for a deadline
+ * in a loop.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "deadline.h"
+
+_Static_assert(DEADLINE_NUM <= 32,
+               "DEADLINE_NUM must fit in the deadline_armed bitmask");
+
+static uint32_t deadline_armed;
+static uint32_t deadline_at[DEADLINE_NUM];
+static deadline_fn_t deadline_fn[DEADLINE_NUM];
+
+/*
+ * deadline_set
+ *
+ * Arm a deadline, replacing an earlier one with the same id
+ */
+void
+deadline_set(uint8_t id, uint32_t at_us, deadline_fn_t fn)
+{
+    deadline_at[id] = at_us;
+    deadline_fn[id] = fn;
+    deadline_armed |= (1U << id);
+}
+
+/*
+ * deadline_cancel
+ *
+ * Disarm a deadline
+ */
+void
+deadline_cancel(uint8_t id)
+{
+    deadline_armed &= ~(1U << id);
+}
+
+/*
+ * deadline_run
+ *
+ * Call the function of every deadline that passed at now_us. A deadline is
+ * disarmed before its function is called, so the function can arm it again.
+ */
+void
+deadline_run(uint32_t now_us)
+{
+    uint32_t todo = deadline_armed;
+    uint8_t id;
+
+    while (todo) {
+        id = __builtin_ctz(todo);
+        todo &= ~(1U << id);
+        if ((int32_t)(now_us - deadline_at[id]) >= 0) {
+            deadline_armed &= ~(1U << id);
+            deadline_fn[id](deadline_at[id]);
+        }
+    }
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Debounce
+ *
+ * Per key debounce of the matrix, split from the scanning so that it does
+ * not touch the hardware and can be run on the host by test/debounce.c.
+ * matrix_scan hands in the raw matrix a word at a time; committed keys end
+ * up in matrix.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "debounce.h"
+#include "matrix.h"
+
+/*
+ * Debounce uses vertical counters: DEBOUNCE_BITS bit planes, each a
+ * matrix_t, hold a small counter per key. Bit b of the counter for key
+ * (r, c) lives in bit MATRIX_BIT(r, c) of debounce_count[b]. This allows all
+ * keys in a word to be counted with a handful of bitwise operations.
+ *
+ * The debounce window of each key is kept in the same layout in
+ * debounce_limit, so every key can have its own window.
+ */
+#define DEBOUNCE_BITS   4
+
+#if MS_DEBOUNCE_MAX >= (1 << DEBOUNCE_BITS)
+#error MS_DEBOUNCE_MAX does not fit in DEBOUNCE_BITS
+#endif
+
+#if (MS_DEBOUNCE < MS_DEBOUNCE_MIN) || (MS_DEBOUNCE > MS_DEBOUNCE_MAX)
+#error MS_DEBOUNCE must be between MS_DEBOUNCE_MIN and MS_DEBOUNCE_MAX
+#endif
+
+/*
+ * Number of transitions that need less than the current window before the
+ * window of a key is shrunk by one ms.
+ */
+#define DEBOUNCE_DECAY  32
+
+static matrix_t matrix_debounce;
+static matrix_t matrix_lockout;
+static matrix_t debounce_count[DEBOUNCE_BITS];
+static matrix_t debounce_limit[DEBOUNCE_BITS];
+uint8_t debounce_mode = DEBOUNCE_MODE;
+uint8_t debounce_ms[DEBOUNCE_KEYS];
+
+#if DEBOUNCE_ADAPTIVE
+static matrix_t matrix_bouncing;
+static uint16_t bounce_start[ROWS_NUM * COLS_NUM];
+static uint16_t bounce_last[ROWS_NUM * COLS_NUM];
+static uint8_t bounce_decay[ROWS_NUM * COLS_NUM];
+#endif
+
+/*
+ * debounce_limit_set
+ *
+ * Set the debounce window of a single key, limited to the allowed range.
+ */
+static void
+debounce_limit_set(uint8_t r, uint8_t c, uint8_t ms)
+{
+    uint8_t w = MATRIX_BIT(r, c) / 32;
+    uint32_t bit = (1U << (MATRIX_BIT(r, c) % 32));
+    uint8_t b;
+
+    if (ms < MS_DEBOUNCE_MIN) {
+        ms = MS_DEBOUNCE_MIN;
+    } else if (ms > MS_DEBOUNCE_MAX) {
+        ms = MS_DEBOUNCE_MAX;
+    }
+
+    debounce_ms[(r * COLS_NUM) + c] = ms;
+
+    for (b = 0; b < DEBOUNCE_BITS; b++) {
+        if (ms & (1 << b)) {
+            debounce_limit[b].word[w] |= bit;
+        } else {
+            debounce_limit[b].word[w] &= ~bit;
+        }
+        debounce_count[b].word[w] &= ~bit;
+    }
+}
+
+/*
+ * matrix_load_debounce
+ *
+ * Take over the debounce windows stored in debounce_ms, i.e. after they have
+ * been read from flash.
+ */
+void
+matrix_load_debounce(void)
+{
+    uint8_t r, c;
+
+    for (r = 0; r < ROWS_NUM; r++) {
+        for (c = 0; c < COLS_NUM; c++) {
+            debounce_limit_set(r, c, debounce_ms[(r * COLS_NUM) + c]);
+        }
+    }
+}
+
+/*
+ * debounce_init
+ *
+ * Start with no keys down and the default window for every key
+ */
+void
+debounce_init(void)
+{
+    memset(&matrix_debounce, 0, sizeof(matrix_debounce));
+    memset(&debounce_ms, MS_DEBOUNCE, sizeof(debounce_ms));
+    matrix_load_debounce();
+    debounce_reset();
+}
+
+/*
+ * debounce_reset
+ *
+ * Restart all keys that are being debounced, i.e. after the strategy
+ * changed
+ */
+void
+debounce_reset(void)
+{
+    memset(&matrix_lockout, 0, sizeof(matrix_lockout));
+    memset(&debounce_count, 0, sizeof(debounce_count));
+#if DEBOUNCE_ADAPTIVE
+    memset(&matrix_bouncing, 0, sizeof(matrix_bouncing));
+#endif
+}
+
+/*
+ * debounce_count_word
+ *
+ * Add one ms to the counter of every key in active, and return the keys
+ * whose counter reached their debounce window. Counters of those keys are
+ * restarted.
+ */
+static uint32_t
+debounce_count_word(uint8_t w, uint32_t active)
+{
+    uint32_t carry, done;
+    uint8_t b;
+
+    carry = active;
+    for (b = 0; b < DEBOUNCE_BITS; b++) {
+        debounce_count[b].word[w] ^= carry;
+        carry &= ~debounce_count[b].word[w];
+    }
+
+    done = active;
+    for (b = 0; b < DEBOUNCE_BITS; b++) {
+        done &= ~(debounce_count[b].word[w] ^ debounce_limit[b].word[w]);
+    }
+
+    if (done) {
+        for (b = 0; b < DEBOUNCE_BITS; b++) {
+            debounce_count[b].word[w] &= ~done;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * debounce_defer_word
+ *
+ * Per key debounce of one word. A key is committed to the matrix once its raw
+ * value differs from the committed value and has not changed for its debounce
+ * window. Keys that bounce restart their own window only; other keys in the
+ * matrix are not delayed.
+ */
+static void
+debounce_defer_word(uint8_t w, uint32_t raw, bool tick)
+{
+    uint32_t pending;
+    uint8_t b;
+
+    /* keys that differ from the committed state and did not bounce */
+    pending = (raw ^ matrix.word[w]) & ~(raw ^ matrix_debounce.word[w]);
+    matrix_debounce.word[w] = raw;
+
+    for (b = 0; b < DEBOUNCE_BITS; b++) {
+        debounce_count[b].word[w] &= pending;
+    }
+
+    if (tick && pending) {
+        matrix.word[w] ^= debounce_count_word(w, pending);
+    }
+}
+
+/*
+ * debounce_eager_word
+ *
+ * Commit a key on the first edge that differs from the committed value, and
+ * then ignore that key for its debounce window so the bounce that follows
+ * the edge is not reported.
+ */
+static void
+debounce_eager_word(uint8_t w, uint32_t raw, bool tick)
+{
+    uint32_t changed;
+
+    changed = (raw ^ matrix.word[w]) & ~matrix_lockout.word[w];
+    matrix.word[w] ^= changed;
+    matrix_lockout.word[w] |= changed;
+    matrix_debounce.word[w] = raw;
+
+    if (tick && matrix_lockout.word[w]) {
+        matrix_lockout.word[w] &= ~debounce_count_word(w, matrix_lockout.word[w]);
+    }
+}
+
+#if DEBOUNCE_ADAPTIVE
+/*
+ * debounce_learn
+ *
+ * Adjust the debounce window of a key to the bounce time observed during
+ * its last transition. Windows grow at once, so a worn switch does not
+ * produce ghost events more than once, and shrink slowly.
+ */
+static void
+debounce_learn(uint8_t r, uint8_t c, uint16_t bounce)
+{
+    uint16_t key = (r * COLS_NUM) + c;
+    uint8_t current = debounce_ms[key];
+    uint16_t wanted = bounce + MS_DEBOUNCE_MARGIN;
+
+    if (wanted > current) {
+        bounce_decay[key] = 0;
+        debounce_limit_set(r, c, (wanted > MS_DEBOUNCE_MAX) ? MS_DEBOUNCE_MAX : wanted);
+    } else if ((wanted < current) &&
+               (++bounce_decay[key] >= DEBOUNCE_DECAY)) {
+        bounce_decay[key] = 0;
+        debounce_limit_set(r, c, current - 1);
+    } else if (wanted == current) {
+        bounce_decay[key] = 0;
+    }
+}
+
+/*
+ * debounce_learn_word
+ *
+ * Measure the bounce time of the keys in a word; the time between the first
+ * and the last edge of a transition. A transition ends when a key has been
+ * quiet for MS_DEBOUNCE_MAX ms, independent of the window currently in use.
+ */
+static void
+debounce_learn_word(uint8_t w, uint32_t edges, uint16_t now, bool tick)
+{
+    uint32_t todo, bit;
+    uint16_t k, key;
+
+    todo = edges;
+    if (tick) {
+        todo |= matrix_bouncing.word[w];
+    }
+
+    while (todo) {
+        k = __builtin_ctz(todo);
+        bit = (1U << k);
+        todo &= ~bit;
+        k += w * 32;
+        key = (MATRIX_ROW(k) * COLS_NUM) + MATRIX_COL(k);
+
+        if (edges & bit) {
+            if (!(matrix_bouncing.word[w] & bit)) {
+                matrix_bouncing.word[w] |= bit;
+                bounce_start[key] = now;
+            }
+            bounce_last[key] = now;
+        } else if ((uint16_t)(now - bounce_last[key]) >= MS_DEBOUNCE_MAX) {
+            matrix_bouncing.word[w] &= ~bit;
+            debounce_learn(MATRIX_ROW(k), MATRIX_COL(k),
+                           bounce_last[key] - bounce_start[key]);
+        }
+    }
+}
+#endif
+
+/*
+ * debounce_word
+ *
+ * Debounce one word of the raw matrix, scanned at now ms; tick is set on
+ * the first scan of a new ms. Returns the keys in the word that are down,
+ * being debounced or being watched for bounce.
+ */
+uint32_t
+debounce_word(uint8_t w, uint32_t raw, uint16_t now, bool tick)
+{
+    uint32_t edges = raw ^ matrix_debounce.word[w];
+
+    if (debounce_mode == DEBOUNCE_EAGER) {
+        debounce_eager_word(w, raw, tick);
+    } else {
+        debounce_defer_word(w, raw, tick);
+    }
+#if DEBOUNCE_ADAPTIVE
+    debounce_learn_word(w, edges, now, tick);
+    return raw | matrix.word[w] | matrix_lockout.word[w] |
+           matrix_bouncing.word[w];
+#else
+    (void)edges;
+    (void)now;
+    return raw | matrix.word[w] | matrix_lockout.word[w];
+#endif
+}
@@ -40,41 +40,16 @@
 #include <libopencm3/stm32/rcc.h>
 
 #include "config.h"
+#include "combo.h"
 #include "keymap.h"
+#include "leader.h"
 #include "keyboard.h"
 #include "macro.h"
+#include "matrix.h"
 #include "elog.h"
-
-#if MACRO_MAXKEYS % 4
-/* flash reads and writes are in 4 byte increments. While other values
- * will work, they can clobber whatever is allocated right next to
- * macro_len */
-#error MACRO_MAXKEYS must be a multiple of 4
-#endif
-
-typedef struct {
-    const uint8_t data[FLASH_PAGE_NUM][FLASH_PAGE_SIZE];
-} __attribute__ ((packed)) flashpage_t;
-
-typedef struct {
-    event_t keymap[LAYERS_NUM][ROWS_NUM][COLS_NUM];
-    event_t macro_buffer[MACRO_MAXKEYS][MACRO_MAXLEN];
-    uint8_t macro_len[MACRO_MAXKEYS];
-    uint32_t layer;
-    uint32_t nkro_active;
-} __attribute__ ((packed)) flashdata_t;
-
-typedef struct {
-    uint32_t data[sizeof(flashdata_t) >> 2];
-    uint32_t zero[(sizeof(flashpage_t) - sizeof(flashdata_t) - sizeof(uint32_t)) >> 2];
-    uint32_t crc;
-} __attribute__ ((packed, aligned(4))) flashcrc_t;
-
-typedef union {
-    flashpage_t page;
-    flashdata_t data;
-    flashcrc_t crc;
-} __attribute__ ((packed, aligned(4))) flash_t;
+#include "flash.h"
+#include "override.h"
+#include "tapdance.h"
 
 flash_t flash __attribute__ ((section(".userflash")));
 
@@ -143,13 +118,29 @@ flash_read_config(void)
         return 0;
     }
 
+    if (!keymap_check(flash.data.keymap_present)) {
+        elog("keymap has too many cells");
+        return 0;
+    }
+
     cm_disable_interrupts();
-    memcpy(keymap, flash.data.keymap, sizeof(flash.data.keymap));
+    memcpy(keymap_present, flash.data.keymap_present, sizeof(flash.data.keymap_present));
+    memcpy(keymap_cells, flash.data.keymap_cells, sizeof(flash.data.keymap_cells));
     memcpy(macro_buffer, flash.data.macro_buffer, sizeof(flash.data.macro_buffer));
     memcpy(macro_len, flash.data.macro_len, sizeof(flash.data.macro_len));
-    layer = flash.data.layer;
+    layer_default = flash.data.layer % LAYERS_NUM;
+    keymap_init();
     nkro_active = flash.data.nkro_active;
+    memcpy(debounce_ms, flash.data.debounce_ms, sizeof(flash.data.debounce_ms));
+    matrix_load_debounce();
+    memcpy(combos, flash.data.combos, sizeof(flash.data.combos));
+    combo_init();
+    memcpy(leader_trie, flash.data.leader_trie, sizeof(flash.data.leader_trie));
+    memcpy(overrides, flash.data.overrides, sizeof(flash.data.overrides));
+    override_init();
+    memcpy(tapdances, flash.data.tapdances, sizeof(flash.data.tapdances));
     cm_enable_interrupts();
+    usb_poll_set(flash.data.usb_poll % USB_POLL_NUM);
 
     return 1;
 }
@@ -193,9 +184,14 @@ flash_write_config(void)
 
     elog("writing configuration");
 
-    if (! flash_write_block(&flash.data.keymap,
-                            keymap,
-                            sizeof(flash.data.keymap))) {
+    if (! flash_write_block(&flash.data.keymap_present,
+                            keymap_present,
+                            sizeof(flash.data.keymap_present))) {
+        return 0;
+    }
+    if (! flash_write_block(&flash.data.keymap_cells,
+                            keymap_cells,
+                            sizeof(flash.data.keymap_cells))) {
         return 0;
     }
     if (! flash_write_block(&flash.data.macro_buffer,
@@ -208,7 +204,7 @@ flash_write_config(void)
                            sizeof(flash.data.macro_len))) {
         return 0;
     }
-    data = (uint32_t)layer;
+    data = (uint32_t)layer_default;
     if (!flash_write_block(&flash.data.layer,
                            &data,
                            sizeof(data))) {
@@ -220,6 +216,36 @@ flash_write_config(void)
                            sizeof(data))) {
         return 0;
     }
+    if (!flash_write_block(&flash.data.debounce_ms,
+                           debounce_ms,
+                           sizeof(flash.data.debounce_ms))) {
+        return 0;
+    }
+    if (!flash_write_block(&flash.data.combos,
+                           combos,
+                           sizeof(flash.data.combos))) {
+        return 0;
+    }
+    if (!flash_write_block(&flash.data.leader_trie,
+                           leader_trie,
+                           sizeof(flash.data.leader_trie))) {
+        return 0;
+    }
+    if (!flash_write_block(&flash.data.overrides,
+                           overrides,
+                           sizeof(flash.data.overrides))) {
+        return 0;
+    }
+    if (!flash_write_block(&flash.data.tapdances,
+                           tapdances,
+                           sizeof(flash.data.tapdances))) {
+        return 0;
+    }
+    if (!flash_write_block(&flash.data.usb_poll,
+                           &usb_poll,
+                           sizeof(usb_poll))) {
+        return 0;
+    }
     crc = flash_crc();
     if (!flash_write_block(&flash.crc.crc, &crc, sizeof(crc))) {
         return 0;
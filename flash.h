@@ -30,6 +30,66 @@
 
 #include <stdint.h>
 
+#include "config.h"
+#include "combo.h"
+#include "keymap.h"
+#include "leader.h"
+#include "matrix.h"
+#include "override.h"
+#include "tapdance.h"
+#include "usb.h"
+
+#if MACRO_MAXKEYS % 4
+/* flash reads and writes are in 4 byte increments. While other values
+ * will work, they can clobber whatever is allocated right next to
+ * macro_len */
+#error MACRO_MAXKEYS must be a multiple of 4
+#endif
+
+#if OVERRIDE_NUM % 4
+/* overrides are 7 bytes; keep the flash writes word sized */
+#error OVERRIDE_NUM must be a multiple of 4
+#endif
+
+/*
+ * Layout of the configuration in user flash, shared with util/keymapc
+ * which builds the same image on the host.
+ */
+typedef struct {
+    const uint8_t data[FLASH_PAGE_NUM][FLASH_PAGE_SIZE];
+} __attribute__ ((packed)) flashpage_t;
+
+typedef struct {
+    matrix_t keymap_present[LAYERS_NUM];
+    event_t keymap_cells[KEYMAP_CELLS];
+    event_t macro_buffer[MACRO_MAXKEYS][MACRO_MAXLEN];
+    uint8_t macro_len[MACRO_MAXKEYS];
+    uint32_t layer;
+    uint32_t nkro_active;
+    uint8_t debounce_ms[DEBOUNCE_KEYS];
+    combo_t combos[COMBO_NUM];
+    leader_node_t leader_trie[LEADER_NODES];
+    override_t overrides[OVERRIDE_NUM];
+    tapdance_t tapdances[TAPDANCE_NUM];
+    uint32_t usb_poll;
+} __attribute__ ((packed)) flashdata_t;
+
+/* raising table sizes in config.h must leave room for the crc */
+_Static_assert(sizeof(flashdata_t) <= sizeof(flashpage_t) - sizeof(uint32_t),
+               "configuration does not fit in user flash");
+
+typedef struct {
+    uint32_t data[sizeof(flashdata_t) >> 2];
+    uint32_t zero[(sizeof(flashpage_t) - sizeof(flashdata_t) - sizeof(uint32_t)) >> 2];
+    uint32_t crc;
+} __attribute__ ((packed, aligned(4))) flashcrc_t;
+
+typedef union {
+    flashpage_t page;
+    flashdata_t data;
+    flashcrc_t crc;
+} __attribute__ ((packed, aligned(4))) flash_t;
+
 void crc_init(void);
 
 uint32_t flash_clear_config(void);
@@ -32,6 +32,8 @@
  * host.
  */
 
+#include "config.h"
+#include "deadline.h"
 #include "usb.h"
 #include "keyboard.h"
 #include "usb_keycode.h"
@@ -40,14 +42,26 @@
 
 static report_keyboard_t keyboard_state;
 static bool keyboard_dirty = false;
+static uint8_t keyboard_mods = 0;
 bool keyboard_active = false;
-uint8_t keyboard_idle = 0;
+uint8_t keyboard_idle = 125;
 
 static report_nkro_t nkro_state;
 bool nkro_active = false;
 static bool nkro_dirty = false;
 uint8_t nkro_idle = 0;
 
+/*
+ * One-shot modifiers: keyboard_oneshot waits for the next key press, and is
+ * then sent as keyboard_applied in the same report as that key. The next
+ * keyboard event drops keyboard_applied again.
+ */
+static uint8_t keyboard_oneshot_mods = 0;
+static uint8_t keyboard_applied = 0;
+
+/* modifiers kept out of the reports while a key override is held */
+static uint8_t keyboard_suppressed = 0;
+
 void
 keyboard_set_protocol(uint8_t protocol)
 {
@@ -77,6 +91,102 @@ keyboard_set_leds(uint8_t leds)
     led_state(leds);
 }
 
+/*
+ * keyboard_update_mods
+ *
+ * Put the held and applied one-shot modifiers in the reports
+ */
+static void
+keyboard_update_mods(void)
+{
+    uint8_t mods = (keyboard_mods | keyboard_applied) & ~keyboard_suppressed;
+
+    if (mods == keyboard_state.mods) {
+        return;
+    }
+
+    keyboard_state.mods = mods;
+    nkro_state.mods = mods;
+
+    if (nkro_active) {
+        nkro_dirty = true;
+    } else {
+        keyboard_dirty = true;
+    }
+}
+
+/*
+ * keyboard_oneshot_expire
+ *
+ * No key was pressed in time after a one-shot modifier; it never made it
+ * into a report, so nothing needs to be sent.
+ */
+static void
+keyboard_oneshot_expire(uint32_t at_us)
+{
+    (void)at_us;
+
+    keyboard_oneshot_mods = 0;
+}
+
+/*
+ * keyboard_oneshot
+ *
+ * Apply modifier to the next key press
+ */
+void
+keyboard_oneshot(uint8_t modifier, uint32_t now_us)
+{
+    elog("oneshot %02x", modifier);
+
+    keyboard_oneshot_mods |= modifier;
+    deadline_set(DEADLINE_ONESHOT_MOD, now_us + (MS_ONESHOT_TIMEOUT * 1000),
+                 keyboard_oneshot_expire);
+}
+
+/*
+ * keyboard_send
+ *
+ * Send the reports that changed
+ */
+static void
+keyboard_send(void)
+{
+    if (keyboard_dirty) {
+        usb_update_keyboard(&keyboard_state);
+        keyboard_dirty = false;
+    }
+
+    if (nkro_dirty) {
+        usb_update_nkro(&nkro_state);
+        nkro_dirty = false;
+    }
+}
+
+/*
+ * keyboard_get_mods
+ *
+ * Return the modifiers that are held or wait as one-shot for the next key
+ */
+uint8_t
+keyboard_get_mods(void)
+{
+    return keyboard_mods | keyboard_oneshot_mods;
+}
+
+/*
+ * keyboard_suppress
+ *
+ * Keep modifiers out of the reports, until called again with 0
+ */
+void
+keyboard_suppress(uint8_t modifier)
+{
+    keyboard_suppressed = modifier;
+    keyboard_update_mods();
+    keyboard_send();
+}
+
 void
 keyboard_event(event_t *event, bool pressed)
 {
@@ -85,6 +195,14 @@ keyboard_event(event_t *event, bool pressed)
 
     elog("key %02x %02x %d", mod, key, pressed);
 
+    keyboard_applied = 0;
+    if (key && pressed && keyboard_oneshot_mods) {
+        keyboard_applied = keyboard_oneshot_mods;
+        keyboard_oneshot_mods = 0;
+        deadline_cancel(DEADLINE_ONESHOT_MOD);
+    }
+    keyboard_update_mods();
+
     if (mod) {
         if (pressed) {
             keyboard_add_modifier(mod);
@@ -101,15 +219,7 @@ keyboard_event(event_t *event, bool pressed)
         }
     }
 
-    if (keyboard_dirty) {
-        usb_update_keyboard(&keyboard_state);
-        keyboard_dirty = false;
-    }
-
-    if (nkro_dirty) {
-        usb_update_nkro(&nkro_state);
-        nkro_dirty = false;
-    }
+    keyboard_send();
 }
 
 void
@@ -172,25 +282,13 @@ keyboard_del_key(uint8_t key)
 void
 keyboard_add_modifier(uint8_t modifier)
 {
-    keyboard_state.mods |= modifier;
-    nkro_state.mods |= modifier;
-
-    if (nkro_active) {
-        nkro_dirty = true;
-    } else {
-        keyboard_dirty = true;
-    }
+    keyboard_mods |= modifier;
+    keyboard_update_mods();
 }
 
 void
 keyboard_del_modifier(uint8_t modifier)
 {
-    keyboard_state.mods &= ~modifier;
-    nkro_state.mods &= ~modifier;
-
-    if (nkro_active) {
-        nkro_dirty = true;
-    } else {
-        keyboard_dirty = true;
-    }
+    keyboard_mods &= ~modifier;
+    keyboard_update_mods();
 }
@@ -43,6 +43,9 @@ void keyboard_del_key(uint8_t key);
 void keyboard_set_leds(uint8_t leds);
 void keyboard_add_modifier(uint8_t modifier);
 void keyboard_del_modifier(uint8_t modifier);
+void keyboard_oneshot(uint8_t modifier, uint32_t now_us);
+uint8_t keyboard_get_mods(void);
+void keyboard_suppress(uint8_t modifier);
 
 extern uint8_t nkro_idle;
 extern bool nkro_active;
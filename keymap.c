@@ -36,36 +36,223 @@
 #include <string.h>
 
 #include "automouse.h"
+#include "clock.h"
+#include "combo.h"
 #include "config.h"
+#include "deadline.h"
 #include "elog.h"
 #include "extrakey.h"
 #include "keyboard.h"
 #include "keymap.h"
+#include "leader.h"
 #include "macro.h"
+#include "matrix.h"
 #include "mouse.h"
+#include "override.h"
+#include "queue.h"
 #include "serial.h"
+#include "tapdance.h"
 #include "usb_keycode.h"
 
-event_t keymap[LAYERS_NUM][ROWS_NUM][COLS_NUM] =
+/*
+ * The keymap loaded by keymap_reset, i.e. when flash holds no keymap:
+ * keymap_base_present and keymap_base_cells as compiled from 5x5.keymap.
+ */
+#include "generated.h"
+
+#if LAYERS_NUM > 32
+#error LAYERS_NUM must fit in the layer_active bitmask
+#endif
+
+/*
+ * The keymap is sparse: keymap_present holds, per layer, a bit for every
+ * key that is not transparent on that layer, and keymap_cells holds the
+ * events of those keys packed in layer and bit order. The cell of a key is
+ * found with keymap_offset, the first cell of each layer word, plus the
+ * popcount of the present bits below the key.
+ */
+matrix_t keymap_present[LAYERS_NUM];
+event_t keymap_cells[KEYMAP_CELLS];
+
+static uint16_t keymap_offset[LAYERS_NUM][MATRIX_WORDS];
+static uint16_t keymap_used;
+
+static event_t keymap_transparent = _TR;
+
+uint8_t layer_default = 0;
+uint32_t layer_active = 0;
+uint32_t layer_oneshot = 0;
+
+/* Per key bitmask of the layers on which the key is not transparent */
+static uint32_t keymap_layers[ROWS_NUM][COLS_NUM];
+
+/*
+ * Resolved event per key under the current layer stack. keymap_cached holds
+ * a bit per column for every row whose cache entry is valid; entries are
+ * resolved again on first use after the layers or the keymap changed.
+ */
+static event_t *keymap_cache[ROWS_NUM][COLS_NUM];
+static uint32_t keymap_cached[ROWS_NUM];
+
+/*
+ * The event each key that is down was pressed with, so its release always
+ * matches the press whatever happened to the layers or keymap meanwhile.
+ */
+static event_t keymap_latched[ROWS_NUM][COLS_NUM];
+
+/*
+ * Keys that are down with a key override, and the modifiers suppressed
+ * until the last of them is released.
+ */
+static uint32_t keymap_overridden[ROWS_NUM];
+static uint8_t keymap_overrides;
+static uint8_t keymap_suppress;
+
+/* Timestamp of the key event being acted on */
+static uint32_t keymap_us;
+
+/*
+ * keymap_flush
+ *
+ * Invalidate all resolved events
+ */
+static void
+keymap_flush(void)
 {
-    {
-        { _K(F13), _K(F14), _K(F15), _K(F16), _K(F17) },
-        { _K(F18), _K(F19), _K(F20), _K(F21), _K(F22) },
-        { _C(VOLUMEINC), _C(VOLUMEDEC), _C(PLAY), _C(FASTFORWARD), _C(MUTE) },
-        { _K(PAD_1), _K(PAD_2), _K(PAD_3), _K(PAD_4), _K(PAD_5) },
-        { _MA(0), _K(PAD_7), _AM(MOUSE_BUTTON1, 20, 1), _K(PAD_9), _MA(1) }
-    },
-};
+    memset(keymap_cached, 0, sizeof(keymap_cached));
+}
+
+/*
+ * keymap_update
+ *
+ * Recalculate the layers on which a key is not transparent
+ */
+static void
+keymap_update(uint8_t r, uint8_t c)
+{
+    uint16_t k = MATRIX_BIT(r, c);
+    uint8_t l;
+
+    keymap_layers[r][c] = 0;
+    for (l = 0; l < LAYERS_NUM; l++) {
+        if (keymap_present[l].word[k / 32] & (1U << (k % 32))) {
+            keymap_layers[r][c] |= (1U << l);
+        }
+    }
+}
+
+/*
+ * keymap_index
+ *
+ * Recalculate the first cell of every layer word
+ */
+static void
+keymap_index(void)
+{
+    uint8_t l, w;
+
+    keymap_used = 0;
+    for (l = 0; l < LAYERS_NUM; l++) {
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            keymap_offset[l][w] = keymap_used;
+            keymap_used += __builtin_popcount(keymap_present[l].word[w]);
+        }
+    }
+}
+
+/*
+ * keymap_cell
+ *
+ * Return the cell a key has, or would have, on a layer
+ */
+static uint16_t
+keymap_cell(uint8_t l, uint16_t k)
+{
+    uint32_t below = (1U << (k % 32)) - 1;
 
-uint8_t layer = 0;
+    return keymap_offset[l][k / 32] +
+        __builtin_popcount(keymap_present[l].word[k / 32] & below);
+}
+
+/*
+ * keymap_check
+ *
+ * Return whether a keymap with these presence bitmaps, as stored in flash,
+ * fits in the cells
+ */
+bool
+keymap_check(const void *present)
+{
+    matrix_t layer;
+    uint16_t used = 0;
+    uint8_t l, w;
+
+    for (l = 0; l < LAYERS_NUM; l++) {
+        memcpy(&layer, (const uint8_t *)present + l * sizeof(layer),
+               sizeof(layer));
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            used += __builtin_popcount(layer.word[w]);
+        }
+    }
+    return (used <= KEYMAP_CELLS);
+}
+
+/*
+ * keymap_init
+ *
+ * Drop all momentary and toggled layers, and take over the keymap, i.e.
+ * after it has been read from flash.
+ */
+void
+keymap_init(void)
+{
+    uint8_t r, c;
+
+    layer_active = 0;
+    layer_oneshot = 0;
+    keymap_flush();
+
+    keymap_index();
+
+    for (r = 0; r < ROWS_NUM; r++) {
+        for (c = 0; c < COLS_NUM; c++) {
+            keymap_update(r, c);
+        }
+    }
+}
+
+/*
+ * keymap_reset
+ *
+ * Replace the keymap by the one compiled in
+ */
+void
+keymap_reset(void)
+{
+    memcpy(keymap_present, keymap_base_present, sizeof(keymap_present));
+    memset(keymap_cells, 0, sizeof(keymap_cells));
+    memcpy(keymap_cells, keymap_base_cells, sizeof(keymap_base_cells));
+    keymap_init();
+}
 
 void
 keymap_dump()
 {
-    uint8_t l, r, c;
+    uint8_t l, r, c, w;
     event_t *e;
 
+    printfnl("layers %08x, default %02x, cells %d/%d",
+             layer_active, layer_default, keymap_used, KEYMAP_CELLS);
     for (l = 0; l < LAYERS_NUM; l++) {
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            if (keymap_present[l].word[w]) {
+                break;
+            }
+        }
+        if (w == MATRIX_WORDS) {
+            /* fully transparent */
+            continue;
+        }
         printfnl("layer %02x", l);
         for (r = 0; r < ROWS_NUM; r++) {
             printf("row %02x: ", r);
@@ -85,34 +272,183 @@ keymap_dump()
 event_t *
 keymap_get(uint8_t l, uint8_t r, uint8_t c)
 {
-    if ((l > LAYERS_NUM) ||
-        (r > ROWS_NUM) ||
-        (c > COLS_NUM)) {
+    if ((l >= LAYERS_NUM) ||
+        (r >= ROWS_NUM) ||
+        (c >= COLS_NUM)) {
         elog("keymap position out of bounds");
         return 0;
     }
 
-    return &keymap[l][r][c];
+    if (!(keymap_layers[r][c] & (1U << l))) {
+        return &keymap_transparent;
+    }
+
+    return &keymap_cells[keymap_cell(l, MATRIX_BIT(r, c))];
 }
 
+/*
+ * keymap_set
+ *
+ * Set the event of a key on a layer. Making a key transparent frees its
+ * cell, any other event takes one; the cells after it move along.
+ */
 void
 keymap_set(uint8_t l, uint8_t r, uint8_t c, event_t *event)
 {
-    if ((l > LAYERS_NUM) ||
-        (r > ROWS_NUM) ||
-        (c > COLS_NUM)) {
+    uint16_t k = MATRIX_BIT(r, c);
+    uint32_t bit = (1U << (k % 32));
+    uint16_t i;
+
+    if ((l >= LAYERS_NUM) ||
+        (r >= ROWS_NUM) ||
+        (c >= COLS_NUM)) {
         elog("keymap position out of bounds");
         return;
     }
 
-    memcpy(&keymap[l][r][c], event, sizeof(event_t));
+    i = keymap_cell(l, k);
+    if (keymap_present[l].word[k / 32] & bit) {
+        if (event->type != KMT_TRANSPARENT) {
+            memcpy(&keymap_cells[i], event, sizeof(event_t));
+            keymap_cached[r] &= ~(1U << c);
+            return;
+        }
+        memmove(&keymap_cells[i], &keymap_cells[i + 1],
+                (keymap_used - i - 1) * sizeof(event_t));
+        keymap_present[l].word[k / 32] &= ~bit;
+    } else {
+        if (event->type == KMT_TRANSPARENT) {
+            return;
+        }
+        if (keymap_used >= KEYMAP_CELLS) {
+            elog("keymap full");
+            return;
+        }
+        memmove(&keymap_cells[i + 1], &keymap_cells[i],
+                (keymap_used - i) * sizeof(event_t));
+        memcpy(&keymap_cells[i], event, sizeof(event_t));
+        keymap_present[l].word[k / 32] |= bit;
+    }
+
+    /* cells moved, so every cached event may have */
+    keymap_index();
+    keymap_update(r, c);
+    keymap_flush();
 }
 
-void
-keymap_event(uint16_t row, uint16_t col, bool pressed)
+/*
+ * keymap_resolve
+ *
+ * Find the event of a key on the highest active layer on which that key is
+ * not transparent. The cost does not depend on the number of active layers,
+ * and the result is cached until the layers or the keymap change.
+ */
+static event_t *
+keymap_resolve(uint16_t row, uint16_t col)
 {
-    event_t *event = &keymap[layer][row][col];
+    uint32_t layers;
+    event_t *event = 0;
+
+    if (keymap_cached[row] & (1U << col)) {
+        return keymap_cache[row][col];
+    }
 
+    layers = (layer_active | layer_oneshot | (1U << layer_default)) & keymap_layers[row][col];
+    if (layers) {
+        event = &keymap_cells[keymap_cell(31 - __builtin_clz(layers),
+                                          MATRIX_BIT(row, col))];
+    }
+
+    keymap_cache[row][col] = event;
+    keymap_cached[row] |= (1U << col);
+    return event;
+}
+
+/*
+ * layer_event
+ *
+ * Change the layer stack: momentary layers are active while their key is
+ * down, toggled layers flip on every press and the default layer is
+ * replaced on press.
+ */
+static void
+layer_event(event_t *event, bool pressed)
+{
+    uint32_t bit = (1U << (event->layer.number % LAYERS_NUM));
+    uint32_t active = layer_active;
+    uint8_t base = layer_default;
+
+    switch (event->layer.mode) {
+        case LAYER_MOMENTARY:
+            if (pressed) {
+                layer_active |= bit;
+            } else {
+                layer_active &= ~bit;
+            }
+            break;
+
+        case LAYER_TOGGLE:
+            if (pressed) {
+                layer_active ^= bit;
+            }
+            break;
+
+        default:
+            if (pressed) {
+                layer_default = event->layer.number % LAYERS_NUM;
+            }
+            break;
+    }
+
+    if ((layer_active != active) || (layer_default != base)) {
+        keymap_flush();
+    }
+}
+
+/*
+ * oneshot_expire
+ *
+ * No key was pressed in time after a one-shot layer
+ */
+static void
+oneshot_expire(uint32_t at_us)
+{
+    (void)at_us;
+
+    layer_oneshot = 0;
+    keymap_flush();
+}
+
+/*
+ * oneshot_event
+ *
+ * Arm a one-shot modifier or layer for the next key press
+ */
+static void
+oneshot_event(event_t *event, bool pressed)
+{
+    if (!pressed) {
+        return;
+    }
+
+    if (event->oneshot.flags & ONESHOT_LAYER) {
+        layer_oneshot |= (1U << (event->oneshot.layer % LAYERS_NUM));
+        keymap_flush();
+        deadline_set(DEADLINE_ONESHOT_LAYER, keymap_us + (MS_ONESHOT_TIMEOUT * 1000),
+                     oneshot_expire);
+    } else {
+        keyboard_oneshot(event->oneshot.mod, keymap_us);
+    }
+}
+
+/*
+ * keymap_dispatch
+ *
+ * Hand an event to the module that handles its type
+ */
+void
+keymap_dispatch(event_t *event, bool pressed)
+{
     switch (event->type) {
         case KMT_KEY:
             keyboard_event(event, pressed);
@@ -139,11 +475,327 @@ keymap_event(uint16_t row, uint16_t col, bool pressed)
             break;
 
         case KMT_LAYER:
-            layer = event->layer.number % LAYERS_NUM;
+            layer_event(event, pressed);
             break;
 
         case KMT_MACRO:
             macro_event(event, pressed);
             break;
+
+        case KMT_LEADER:
+            if (pressed) {
+                leader_start(keymap_us);
+            }
+            break;
+
+        case KMT_ONESHOT:
+            oneshot_event(event, pressed);
+            break;
+
+        case KMT_TAPDANCE:
+            tapdance_event(event, pressed, keymap_us);
+            break;
+    }
+}
+
+/*
+ * keymap_press
+ *
+ * Latch the event a key is pressed with, and act on it
+ */
+static void
+keymap_press(uint16_t row, uint16_t col, const event_t *event)
+{
+    event_t *latched = &keymap_latched[row][col];
+    const event_t *override;
+    uint8_t suppress;
+
+    if (event) {
+        *latched = *event;
+    } else {
+        latched->type = KMT_NONE;
+    }
+
+    if ((latched->type == KMT_KEY) &&
+        (override = override_match(latched, &suppress))) {
+        *latched = *override;
+        keymap_overridden[row] |= (1U << col);
+        keymap_overrides++;
+        keymap_suppress |= suppress;
+        keyboard_suppress(keymap_suppress);
+    }
+
+    keymap_dispatch(latched, true);
+}
+
+/*
+ * keymap_release
+ *
+ * Release the event a key was pressed with
+ */
+static void
+keymap_release(uint16_t row, uint16_t col)
+{
+    event_t *latched = &keymap_latched[row][col];
+
+    keymap_dispatch(latched, false);
+    latched->type = KMT_NONE;
+
+    if (keymap_overridden[row] & (1U << col)) {
+        keymap_overridden[row] &= ~(1U << col);
+        if (!--keymap_overrides) {
+            keymap_suppress = 0;
+            keyboard_suppress(0);
+        }
+    }
+}
+
+/*
+ * keymap_act
+ *
+ * Press a key with the event it resolved to, or the action a tap-hold key
+ * was decided to, after a leader sequence, a pending tap-dance and a
+ * one-shot layer had their say.
+ */
+static void
+keymap_act(uint16_t row, uint16_t col, const event_t *event)
+{
+    if (leader_key(row, col, keymap_us)) {
+        /* part of a leader sequence, the release does nothing */
+        keymap_press(row, col, 0);
+        return;
+    }
+    if (!(event && (event->type == KMT_TAPDANCE))) {
+        /* a pending tap-dance acts before the key that interrupts it */
+        tapdance_interrupt();
+    }
+    keymap_press(row, col, event);
+    if (layer_oneshot && !(event && (event->type == KMT_ONESHOT))) {
+        /* the one-shot layer applied to this key only */
+        layer_oneshot = 0;
+        keymap_flush();
+        deadline_cancel(DEADLINE_ONESHOT_LAYER);
+    }
+}
+
+/*
+ * keymap_event
+ *
+ * Take on a key press or release. A press resolves the key against the
+ * layer stack and latches the result; the release uses the latched event.
+ */
+void
+keymap_event(uint16_t row, uint16_t col, bool pressed)
+{
+    if (pressed) {
+        keymap_act(row, col, keymap_resolve(row, col));
+    } else {
+        keymap_release(row, col);
+    }
+}
+
+/*
+ * Tap-hold: a tap-hold key that is pressed is undecided until it is released,
+ * MS_TAPPING_TERM passes or its policy decides on another key. Key events
+ * go through taphold_buffer: events before taphold_next wait for the
+ * undecided key, the others still have to be looked at. Once the key is
+ * decided all waiting events are replayed in order, so other keys only wait
+ * as long as needed. Decisions are taken on event timestamps, or on the
+ * tapping term deadline if no event arrives in time.
+ */
+static struct {
+    bool active;
+    uint8_t row;
+    uint8_t col;
+    event_t event;
+    uint32_t deadline;
+} taphold;
+static keyevent_t taphold_buffer[TAPHOLD_BUFFER];
+static uint8_t taphold_len;
+static uint8_t taphold_next;
+
+enum {
+    TAPHOLD_WAIT = 0,
+    TAPHOLD_TAP,
+    TAPHOLD_HOLD
+};
+
+static void taphold_expire(uint32_t at_us);
+
+/*
+ * taphold_decide
+ *
+ * Press the tap or the hold action of the undecided key, and have the
+ * events that waited for it replayed.
+ */
+static void
+taphold_decide(bool hold)
+{
+    event_t action;
+
+    memset(&action, 0, sizeof(action));
+    if (!hold) {
+        action.type = KMT_KEY;
+        action.key.code = taphold.event.taphold.code;
+    } else if (taphold.event.taphold.mode & TAPHOLD_LAYER) {
+        action.type = KMT_LAYER;
+        action.layer.mode = LAYER_MOMENTARY;
+        action.layer.number = taphold.event.taphold.hold;
+    } else {
+        action.type = KMT_KEY;
+        action.key.mod = taphold.event.taphold.hold;
+    }
+
+    taphold.active = false;
+    taphold_next = 0;
+    deadline_cancel(DEADLINE_TAPHOLD);
+    keymap_act(taphold.row, taphold.col, &action);
+}
+
+/*
+ * taphold_check
+ *
+ * Decide the undecided key on the next event, if its policy allows that
+ */
+static uint8_t
+taphold_check(const keyevent_t *key)
+{
+    uint8_t policy = taphold.event.taphold.mode & TAPHOLD_POLICY;
+    uint8_t i;
+
+    if ((int32_t)(key->timestamp_us - taphold.deadline) >= 0) {
+        /* the tapping term passed before this event */
+        return TAPHOLD_HOLD;
+    }
+
+    if ((key->row == taphold.row) && (key->col == taphold.col)) {
+        return key->pressed ? TAPHOLD_WAIT : TAPHOLD_TAP;
+    }
+
+    if (key->pressed) {
+        return (policy == TAPHOLD_OTHER) ? TAPHOLD_HOLD : TAPHOLD_WAIT;
+    }
+
+    if (policy == TAPHOLD_PERMISSIVE) {
+        /* a key pressed and released while the tap-hold key is down */
+        for (i = 0; i < taphold_next; i++) {
+            if ((taphold_buffer[i].row == key->row) &&
+                (taphold_buffer[i].col == key->col) &&
+                taphold_buffer[i].pressed) {
+                return TAPHOLD_HOLD;
+            }
+        }
     }
+
+    return TAPHOLD_WAIT;
+}
+
+/*
+ * taphold_run
+ *
+ * Look at the buffered key events in order. Events either wait for the
+ * undecided key, decide it, start a new undecided key or are acted on.
+ */
+static void
+taphold_run(void)
+{
+    keyevent_t *key;
+    const event_t *event;
+    uint8_t decision;
+
+    while (taphold_next < taphold_len) {
+        key = &taphold_buffer[taphold_next];
+
+        if (taphold.active) {
+            decision = taphold_check(key);
+            if (decision == TAPHOLD_WAIT) {
+                taphold_next++;
+            } else {
+                taphold_decide(decision == TAPHOLD_HOLD);
+            }
+            continue;
+        }
+
+        /* nothing waits, so this is the first event in the buffer */
+        event = 0;
+        if (key->pressed && key->combo) {
+            event = combo_action(key->combo - 1);
+        } else if (key->pressed) {
+            event = keymap_resolve(key->row, key->col);
+        }
+
+        if (event && (event->type == KMT_TAPHOLD)) {
+            taphold.active = true;
+            taphold.row = key->row;
+            taphold.col = key->col;
+            taphold.event = *event;
+            taphold.deadline = key->timestamp_us + (MS_TAPPING_TERM * 1000);
+            deadline_set(DEADLINE_TAPHOLD, taphold.deadline, taphold_expire);
+        } else {
+            keymap_us = key->timestamp_us;
+            if (key->pressed) {
+                keymap_act(key->row, key->col, event);
+            } else {
+                keymap_release(key->row, key->col);
+            }
+        }
+
+        taphold_len--;
+        memmove(&taphold_buffer[0], &taphold_buffer[1], taphold_len * sizeof(keyevent_t));
+    }
+}
+
+/*
+ * taphold_expire
+ *
+ * The tapping term of the undecided key passed without a decision
+ */
+static void
+taphold_expire(uint32_t at_us)
+{
+    (void)at_us;
+
+    if (taphold.active) {
+        taphold_decide(true);
+        taphold_run();
+    }
+}
+
+/*
+ * keymap_key
+ *
+ * Take on a key event from the matrix; tap-hold keys are held back until
+ * they are decided, everything else is acted on at once.
+ */
+void
+keymap_key(const keyevent_t *key)
+{
+    while (taphold_len >= TAPHOLD_BUFFER) {
+        elog("taphold buffer full");
+        taphold_decide(true);
+        taphold_run();
+    }
+
+    taphold_buffer[taphold_len++] = *key;
+    taphold_run();
+}
+
+/*
+ * keymap_process
+ *
+ * Take on all key events that the matrix has queued, oldest first. Events
+ * pass the combo and then the tap-hold stage. Deadlines that passed before
+ * an event are run before that event.
+ */
+void
+keymap_process(void)
+{
+    keyevent_t event;
+
+    while (queue_pop(&event)) {
+        deadline_run(event.timestamp_us);
+        combo_event(&event);
+    }
+
+    deadline_run(clock_now_us());
 }
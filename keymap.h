@@ -26,7 +26,9 @@
  */
 
 /*
- * A keymap consists of <layers> * <rows> * <colums> of scanmap_t.
+ * A keymap consists of <layers> * <rows> * <colums> of event_t. It is
+ * stored sparse: only the keys that are not transparent on a layer take a
+ * cell, at most KEYMAP_CELLS over all layers.
  *
  *
  * |87654321|87654321|87654321|87654321|
@@ -37,13 +39,34 @@
  * |    0010|buttons |x       |y       |
  * |    0011|buttons |h       |v       |
  * |    0100|buttons |x       |y       |
- * |    0101|layer select              |
+ * |    0101|        |mode    |layer   |
+ * |    1001|transparent              |
+ * |    1010|hold    |mode    |scancode|
+ * |    1011|leader                   |
+ * |    1100|mod     |flags   |layer   |
+ * |    1101|                 |number  |
  * |--------+--------+--------+--------|
+ *
+ * Layers stack: every active layer is a bit in layer_active, and the
+ * default layer is always active. A key takes its event from the highest
+ * active layer on which it is not transparent.
+ *
+ * One-shot keys apply their modifier bits, or with ONESHOT_LAYER their
+ * layer, to the next key press only.
+ *
+ * Tap-dance keys act as one of the events of tapdances[number], depending
+ * on how often they are tapped.
+ *
+ * Tap-hold keys send scancode when tapped, and act as the modifier bits or
+ * momentary layer in hold when held; mode holds the TAPHOLD_ policy and
+ * TAPHOLD_LAYER.
  */
 
 #ifndef _KEYMAP_H
 #define _KEYMAP_H
 #include "config.h"
+#include "matrix.h"
+#include "queue.h"
 
 typedef struct {
     uint8_t type;
@@ -80,9 +103,24 @@ typedef struct {
         } __attribute__ ((packed)) macro;
         struct {
             uint8_t empty5;
-            uint8_t empty6;
+            uint8_t mode;
             uint8_t number;
         } __attribute__ ((packed)) layer;
+        struct {
+            uint8_t hold;
+            uint8_t mode;
+            uint8_t code;
+        } __attribute__ ((packed)) taphold;
+        struct {
+            uint8_t mod;
+            uint8_t flags;
+            uint8_t layer;
+        } __attribute__ ((packed)) oneshot;
+        struct {
+            uint8_t empty6;
+            uint8_t empty7;
+            uint8_t number;
+        } __attribute__ ((packed)) tapdance;
         struct {
             uint8_t num1;
             uint8_t num2;
@@ -91,7 +129,8 @@ typedef struct {
     };
 } __attribute__ ((packed)) event_t;
 
-extern event_t keymap[][ROWS_NUM][COLS_NUM];
+extern matrix_t keymap_present[LAYERS_NUM];
+extern event_t keymap_cells[KEYMAP_CELLS];
 
 enum {
     KMT_NONE = 0,
@@ -103,9 +142,37 @@ enum {
     KMT_MACRO,
     KMT_MOUSE,
     KMT_SYSTEM,
-    KMT_WHEEL
+    KMT_WHEEL,
+    KMT_TRANSPARENT,
+    KMT_TAPHOLD,
+    KMT_LEADER,
+    KMT_ONESHOT,
+    KMT_TAPDANCE
+};
+
+#define ONESHOT_LAYER   0x01
+
+enum {
+    LAYER_DEFAULT = 0,
+    LAYER_MOMENTARY,
+    LAYER_TOGGLE
 };
 
+/*
+ * Tap-hold policies, a key is a hold if it is still down after
+ * MS_TAPPING_TERM, or:
+ * - TAPHOLD_PERMISSIVE: another key is pressed and released within it
+ * - TAPHOLD_OTHER: another key is pressed within it
+ */
+enum {
+    TAPHOLD_TERM = 0,
+    TAPHOLD_PERMISSIVE,
+    TAPHOLD_OTHER
+};
+
+#define TAPHOLD_POLICY  0x0f
+#define TAPHOLD_LAYER   0x80
+
 #define _AM(Button,Times,Wiggle)  {.type = KMT_AUTOMOUSE, .automouse = {.button = Button, .times = Times, .wiggle = Wiggle }}
 #define _B(Button)                {.type = KMT_MOUSE, .mouse = {.button = Button, .x = 0, .y = 0}}
 #define _C(Key)                   {.type = KMT_CONSUMER, .extra = { .code = CONSUMER_##Key }}
@@ -115,18 +182,37 @@ enum {
 #define _KM(ModKey, Key)          {.type = KMT_KEY, .key = { .mod = MOD_##ModKey, .code = KEY_##Key }}
 /* Example CTRL-ALT-DEL: _KMB(MOD_LCTRL|MOD_LALT, DELETE) */
 #define _KMB(ModBits, Key)        {.type = KMT_KEY, .key = { .mod = ModBits, .code = KEY_##Key }}
-#define _L(Layer)                 {.type = KMT_LAYER, .layer = { .number = Layer }}
+#define _LD                       {.type = KMT_LEADER}
+#define _L(Layer)                 {.type = KMT_LAYER, .layer = { .mode = LAYER_DEFAULT, .number = Layer }}
+#define _LM(Layer)                {.type = KMT_LAYER, .layer = { .mode = LAYER_MOMENTARY, .number = Layer }}
+#define _LT(Layer)                {.type = KMT_LAYER, .layer = { .mode = LAYER_TOGGLE, .number = Layer }}
+/* Example CTRL when held, A when tapped: _MT(LCTRL, A, PERMISSIVE) */
+#define _MT(ModKey, Key, Policy)  {.type = KMT_TAPHOLD, .taphold = { .hold = MOD_##ModKey, .mode = TAPHOLD_##Policy, .code = KEY_##Key }}
+/* Example layer 1 when held, SPACE when tapped: _LH(1, SPACE, TERM) */
+#define _LH(Layer, Key, Policy)   {.type = KMT_TAPHOLD, .taphold = { .hold = Layer, .mode = TAPHOLD_LAYER | TAPHOLD_##Policy, .code = KEY_##Key }}
+#define _OL(Layer)                {.type = KMT_ONESHOT, .oneshot = { .flags = ONESHOT_LAYER, .layer = Layer }}
+#define _OM(ModKey)               {.type = KMT_ONESHOT, .oneshot = { .mod = MOD_##ModKey }}
 #define _M(X,Y)                   {.type = KMT_MOUSE, .mouse = {.button = 0, .x = X, .y = Y }}
 #define _MA(Number)               {.type = KMT_MACRO, .macro = { .number = Number }}
+#define _TD(Number)               {.type = KMT_TAPDANCE, .tapdance = { .number = Number }}
+#define _TR                       {.type = KMT_TRANSPARENT}
 #define _S(Mod)                   {.type = KMT_KEY, .key = { .code = 0, .mod = Mod }}
 #define _W(H,V)                   {.type = KMT_WHEEL, .wheel = {.button = 0, .h = H, .v = V }}
 #define _Y(Key)                   {.type = KMT_SYSTEM, .extra = { .code = SYSTEM_##Key }}
 
-extern uint8_t layer;
+extern uint8_t layer_default;
+extern uint32_t layer_active;
+extern uint32_t layer_oneshot;
 
+bool keymap_check(const void *present);
+void keymap_init(void);
+void keymap_reset(void);
 void keymap_dump(void);
 event_t *keymap_get(uint8_t layer, uint8_t row, uint8_t column);
 void keymap_set(uint8_t layer, uint8_t row, uint8_t column, event_t *event);
 void keymap_event(uint16_t row, uint16_t col, bool pressed);
+void keymap_process(void);
+void keymap_key(const keyevent_t *key);
+void keymap_dispatch(event_t *event, bool pressed);
 
 #endif /* _KEYMAP_H */
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * leader
+ *
+ * Leader key: after the leader key, the next key presses are matched
+ * against a trie of sequences. A complete sequence fires its event. Every
+ * key press moves one node down the trie, at the same cost however many
+ * sequences there are.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "deadline.h"
+#include "elog.h"
+#include "keymap.h"
+#include "leader.h"
+#include "serial.h"
+
+#define LEADER_KEYS     (ROWS_NUM * COLS_NUM)
+
+#if LEADER_NODES >= LEADER_NONE
+#error LEADER_NODES does not fit the trie indices
+#endif
+
+leader_node_t leader_trie[LEADER_NODES];
+
+static bool leader_active;
+static uint16_t leader_node;
+
+/*
+ * leader_clear
+ *
+ * Remove all sequences
+ */
+void
+leader_clear(void)
+{
+    uint16_t n;
+
+    for (n = 0; n < LEADER_NODES; n++) {
+        leader_trie[n].base = LEADER_NONE;
+        leader_trie[n].check = LEADER_NONE;
+        leader_trie[n].event.type = KMT_NONE;
+    }
+
+    /* the root is its own parent */
+    leader_trie[0].check = 0;
+    leader_active = false;
+}
+
+/*
+ * leader_child
+ *
+ * Return the child of a node for a key, or LEADER_NONE
+ */
+static uint16_t
+leader_child(uint16_t n, uint16_t key)
+{
+    uint32_t c;
+
+    if (leader_trie[n].base == LEADER_NONE) {
+        return LEADER_NONE;
+    }
+
+    c = leader_trie[n].base + key;
+    if ((c < LEADER_NODES) && (leader_trie[c].check == n)) {
+        return c;
+    }
+
+    return LEADER_NONE;
+}
+
+/*
+ * leader_fire
+ *
+ * Act on the event of a node and leave leader mode
+ */
+static void
+leader_fire(uint16_t n)
+{
+    event_t event = leader_trie[n].event;
+
+    leader_active = false;
+    deadline_cancel(DEADLINE_LEADER);
+    if (event.type != KMT_NONE) {
+        keymap_dispatch(&event, true);
+        keymap_dispatch(&event, false);
+    }
+}
+
+/*
+ * leader_expire
+ *
+ * No key followed in time; fire what has been typed so far, if anything
+ */
+static void
+leader_expire(uint32_t at_us)
+{
+    (void)at_us;
+
+    if (leader_active) {
+        leader_fire(leader_node);
+    }
+}
+
+/*
+ * leader_start
+ *
+ * The leader key was pressed
+ */
+void
+leader_start(uint32_t now_us)
+{
+    leader_active = true;
+    leader_node = 0;
+    deadline_set(DEADLINE_LEADER, now_us + (MS_LEADER_TIMEOUT * 1000), leader_expire);
+}
+
+/*
+ * leader_key
+ *
+ * Take on a key press. Returns true if the key was taken as part of a
+ * sequence, and must not act as itself.
+ */
+bool
+leader_key(uint8_t row, uint8_t col, uint32_t now_us)
+{
+    uint16_t n;
+
+    if (!leader_active) {
+        return false;
+    }
+
+    n = leader_child(leader_node, (row * COLS_NUM) + col);
+    if (n == LEADER_NONE) {
+        /* not a sequence; drop what was typed */
+        leader_active = false;
+        deadline_cancel(DEADLINE_LEADER);
+        return true;
+    }
+
+    leader_node = n;
+    if (leader_trie[n].base == LEADER_NONE) {
+        /* nothing longer can follow */
+        leader_fire(n);
+    } else {
+        deadline_set(DEADLINE_LEADER, now_us + (MS_LEADER_TIMEOUT * 1000), leader_expire);
+    }
+
+    return true;
+}
+
+/*
+ * leader_base
+ *
+ * Find a base at which all keys land on free nodes
+ */
+static uint16_t
+leader_base(const uint16_t *keys, uint16_t len)
+{
+    uint16_t base, i;
+
+    for (base = 1; base < LEADER_NODES; base++) {
+        for (i = 0; i < len; i++) {
+            if (((base + keys[i]) >= LEADER_NODES) ||
+                (leader_trie[base + keys[i]].check != LEADER_NONE)) {
+                break;
+            }
+        }
+        if (i == len) {
+            return base;
+        }
+    }
+
+    return LEADER_NONE;
+}
+
+/*
+ * leader_insert
+ *
+ * Add a child to a node. If the child's place is taken, all children of the
+ * node move to a new base. Returns the child, or LEADER_NONE if the trie is
+ * full.
+ */
+static uint16_t
+leader_insert(uint16_t n, uint16_t key)
+{
+    uint16_t keys[LEADER_KEYS + 1];
+    uint16_t base, from, to, c;
+    uint16_t i, k, len = 0;
+
+    c = leader_trie[n].base + key;
+    if ((leader_trie[n].base == LEADER_NONE) ||
+        (c >= LEADER_NODES) ||
+        (leader_trie[c].check != LEADER_NONE)) {
+        for (k = 0; k < LEADER_KEYS; k++) {
+            if (leader_child(n, k) != LEADER_NONE) {
+                keys[len++] = k;
+            }
+        }
+        keys[len] = key;
+
+        base = leader_base(keys, len + 1);
+        if (base == LEADER_NONE) {
+            return LEADER_NONE;
+        }
+
+        for (i = 0; i < len; i++) {
+            from = leader_trie[n].base + keys[i];
+            to = base + keys[i];
+            leader_trie[to] = leader_trie[from];
+            /* grandchildren now have a new parent */
+            if (leader_trie[from].base != LEADER_NONE) {
+                for (k = 0; k < LEADER_KEYS; k++) {
+                    c = leader_trie[from].base + k;
+                    if ((c < LEADER_NODES) && (leader_trie[c].check == from)) {
+                        leader_trie[c].check = to;
+                    }
+                }
+            }
+            leader_trie[from].base = LEADER_NONE;
+            leader_trie[from].check = LEADER_NONE;
+            leader_trie[from].event.type = KMT_NONE;
+        }
+
+        leader_trie[n].base = base;
+        c = base + key;
+    }
+
+    leader_trie[c].base = LEADER_NONE;
+    leader_trie[c].check = n;
+    leader_trie[c].event.type = KMT_NONE;
+    return c;
+}
+
+/*
+ * leader_add
+ *
+ * Add a sequence of keys, each (row * COLS_NUM) + column, and its event
+ */
+bool
+leader_add(const uint16_t *keys, uint8_t len, event_t *event)
+{
+    uint16_t n = 0, c;
+    uint8_t i;
+
+    leader_active = false;
+
+    if (!len || (len > LEADER_MAXLEN)) {
+        elog("leader sequence needs 1 to %d keys", LEADER_MAXLEN);
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (keys[i] >= LEADER_KEYS) {
+            elog("leader key out of bounds");
+            return false;
+        }
+        c = leader_child(n, keys[i]);
+        if (c == LEADER_NONE) {
+            c = leader_insert(n, keys[i]);
+            if (c == LEADER_NONE) {
+                elog("leader trie full");
+                return false;
+            }
+        }
+        n = c;
+    }
+
+    leader_trie[n].event = *event;
+    return true;
+}
+
+/*
+ * leader_dump_node
+ *
+ * Emit every sequence below a node
+ */
+static void
+leader_dump_node(uint16_t n, uint16_t *keys, uint8_t depth)
+{
+    uint16_t c, k;
+    uint8_t i;
+
+    if (leader_trie[n].event.type != KMT_NONE) {
+        printf("leader ");
+        for (i = 0; i < depth; i++) {
+            printf("%02x%02x ", keys[i] / COLS_NUM, keys[i] % COLS_NUM);
+        }
+        printf("-> %01x,%02x%02x%02x\n\r",
+               leader_trie[n].event.type,
+               leader_trie[n].event.args.num1,
+               leader_trie[n].event.args.num2,
+               leader_trie[n].event.args.num3);
+    }
+
+    if (depth >= LEADER_MAXLEN) {
+        return;
+    }
+
+    for (k = 0; k < LEADER_KEYS; k++) {
+        c = leader_child(n, k);
+        if (c != LEADER_NONE) {
+            keys[depth] = k;
+            leader_dump_node(c, keys, depth + 1);
+        }
+    }
+}
+
+/*
+ * leader_dump
+ *
+ * Emit all sequences and the use of the trie
+ */
+void
+leader_dump(void)
+{
+    uint16_t keys[LEADER_MAXLEN];
+    uint16_t n, used = 0;
+
+    for (n = 0; n < LEADER_NODES; n++) {
+        if (leader_trie[n].check != LEADER_NONE) {
+            used++;
+        }
+    }
+
+    printfnl("leader nodes %d/%d", used, LEADER_NODES);
+    leader_dump_node(0, keys, 0);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _LEADER_H
+#define _LEADER_H
+
+#include "config.h"
+#include "keymap.h"
+
+/*
+ * The leader sequences are kept in a double array trie: the child of node n
+ * for key k is node base + k, if that node has n as its check. Key k is the
+ * matrix position (row * COLS_NUM) + column. Node 0 is the root.
+ */
+#define LEADER_NONE     0xffff
+
+typedef struct {
+    uint16_t base;
+    uint16_t check;
+    event_t event;
+} __attribute__ ((packed)) leader_node_t;
+
+extern leader_node_t leader_trie[LEADER_NODES];
+
+void leader_clear(void);
+void leader_start(uint32_t now_us);
+bool leader_key(uint8_t row, uint8_t col, uint32_t now_us);
+bool leader_add(const uint16_t *keys, uint8_t len, event_t *event);
+void leader_dump(void);
+
+#endif /* _LEADER_H */
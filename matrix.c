@@ -35,23 +35,134 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/exti.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/timer.h>
 
 #include "clock.h"
 #include "config.h"
+#include "debounce.h"
+#include "elog.h"
 #include "serial.h"
 #include "matrix.h"
-#include "keymap.h"
+#include "profile.h"
+#include "queue.h"
 
+/*
+ * Matrix geometry
+ *
+ * The pin lists MATRIX_ROWS and MATRIX_COLS from config.h are turned into
+ * per port masks at compile time. Ports A, B and C are supported; a port
+ * without rows or columns costs nothing during a scan.
+ */
+#define ROW_COUNT(port, pin)            + 1
+#define COL_COUNT(port, pin, num)       + (num)
+
+#if (0 MATRIX_ROWS(ROW_COUNT)) != ROWS_NUM
+#error ROWS_NUM does not match MATRIX_ROWS
+#endif
+
+#if (0 MATRIX_COLS(COL_COUNT)) != COLS_NUM
+#error COLS_NUM does not match MATRIX_COLS
+#endif
+
+#if (ROWS_NUM > 16) || (COLS_NUM > 32)
+#error matrix is limited to 16 rows and 32 columns
+#endif
+
+/*
+ * A run of columns has at least one pin, and lies within its 16 pin port.
+ * That keeps every shift in COL_DECODE below 32 bits, also for a matrix of
+ * 32 columns.
+ */
+#define COL_CHECK(port, pin, num)                                       \
+    _Static_assert(((num) >= 1) && (((pin) + (num)) <= 16),             \
+                   "column run must have 1 to 16 pins within its port");
+
+MATRIX_COLS(COL_CHECK)
+
+#define PIN_MASK(pin, num)              (((1 << (num)) - 1) << (pin))
+#define PORT_INDEX(port)                (((port) - GPIOA) / (GPIOB - GPIOA))
+#define PORT_MASK(port, gpio, mask)     | (((port) == (gpio)) ? (mask) : 0)
+
+#define ROW_MASK_A(port, pin)           PORT_MASK(port, GPIOA, PIN_MASK(pin, 1))
+#define ROW_MASK_B(port, pin)           PORT_MASK(port, GPIOB, PIN_MASK(pin, 1))
+#define ROW_MASK_C(port, pin)           PORT_MASK(port, GPIOC, PIN_MASK(pin, 1))
+#define COL_MASK_A(port, pin, num)      PORT_MASK(port, GPIOA, PIN_MASK(pin, num))
+#define COL_MASK_B(port, pin, num)      PORT_MASK(port, GPIOB, PIN_MASK(pin, num))
+#define COL_MASK_C(port, pin, num)      PORT_MASK(port, GPIOC, PIN_MASK(pin, num))
+
+#define ROWS_MASK_A                     (0 MATRIX_ROWS(ROW_MASK_A))
+#define ROWS_MASK_B                     (0 MATRIX_ROWS(ROW_MASK_B))
+#define ROWS_MASK_C                     (0 MATRIX_ROWS(ROW_MASK_C))
+#define COLS_MASK_A                     (0 MATRIX_COLS(COL_MASK_A))
+#define COLS_MASK_B                     (0 MATRIX_COLS(COL_MASK_B))
+#define COLS_MASK_C                     (0 MATRIX_COLS(COL_MASK_C))
+#define COLS_MASK                       (COLS_MASK_A | COLS_MASK_B | COLS_MASK_C)
+
+#if (COLS_MASK_A & COLS_MASK_B) || (COLS_MASK_A & COLS_MASK_C) || (COLS_MASK_B & COLS_MASK_C)
+#error column pins on different ports share an EXTI line
+#endif
+
+/*
+ * Column decoding: each run of column pins is shifted in from the top, so
+ * after all runs the first run ends up at column 0.
+ */
+#define COL_DECODE(port, pin, num)                                      \
+    c = (c >> (num)) |                                                  \
+        (((idr[PORT_INDEX(port)] >> (pin)) & PIN_MASK(0, num)) << (COLS_NUM - (num)));
+
+#define ROW_PIN(port, pin)              { (port), PIN_MASK(pin, 1) },
+
+static const struct {
+    uint32_t port;
+    uint16_t bit;
+} row_pins[ROWS_NUM] = {
+    MATRIX_ROWS(ROW_PIN)
+};
+
+#define ROW_WORD(r)     (MATRIX_BIT(r, 0) / 32)
+#define ROW_SHIFT(r)    (MATRIX_BIT(r, 0) % 32)
+#define ROW_MASK        (0xffffffffU >> (32 - COLS_NUM))
 
-static uint32_t debounce;
-static bool matrix_update;
 matrix_t matrix;
-static matrix_t matrix_debounce;
 static matrix_t matrix_previous;
+static matrix_t matrix_pending;
+static uint32_t matrix_pending_us;
+static uint32_t debounce_tick;
 uint8_t show_matrix = 0;
 
+/*
+ * Idle mode: after MS_IDLE without keys, all rows are driven high and any
+ * column going high raises an EXTI interrupt. The core can then sleep until
+ * a key is touched instead of scanning.
+ */
+static volatile bool matrix_idle;
+static volatile uint32_t idle_timer;
+static uint32_t idle_start;
+static volatile uint32_t idle_wake_cycles;
+static volatile bool idle_woken;
+static uint32_t idle_count;
+static uint32_t idle_ms;
+static uint32_t wake_cycles_last;
+static uint32_t wake_cycles_max;
+
+/*
+ * Scan cost: scans that only checked for any key against scans that walked
+ * all rows, and the cycles spent in each.
+ */
+static uint32_t scan_active;
+static uint32_t scan_fast_count;
+static uint32_t scan_full_count;
+static uint64_t scan_fast_cycles;
+static uint64_t scan_full_cycles;
+
 /*
  * row_select
  *
@@ -60,32 +171,372 @@ uint8_t show_matrix = 0;
 static void
 row_select(uint8_t r)
 {
-    GPIO_BSRR(ROWS_GPIO) = (1 << r);
+    GPIO_BSRR(row_pins[r].port) = row_pins[r].bit;
 }
 
 /*
  * row_clear
  *
- * Pull a row low
+ * Pull all rows low
  */
 static void
 row_clear(void)
 {
-    GPIO_BSRR(ROWS_GPIO) = (ROWS_BV << 16);
+    if (ROWS_MASK_A) {
+        GPIO_BSRR(GPIOA) = (ROWS_MASK_A << 16);
+    }
+    if (ROWS_MASK_B) {
+        GPIO_BSRR(GPIOB) = (ROWS_MASK_B << 16);
+    }
+    if (ROWS_MASK_C) {
+        GPIO_BSRR(GPIOC) = (ROWS_MASK_C << 16);
+    }
+}
+
+/*
+ * row_all
+ *
+ * Pull all rows high
+ */
+static void
+row_all(void)
+{
+    if (ROWS_MASK_A) {
+        GPIO_BSRR(GPIOA) = ROWS_MASK_A;
+    }
+    if (ROWS_MASK_B) {
+        GPIO_BSRR(GPIOB) = ROWS_MASK_B;
+    }
+    if (ROWS_MASK_C) {
+        GPIO_BSRR(GPIOC) = ROWS_MASK_C;
+    }
+}
+
+/*
+ * col_decode
+ *
+ * Take the column bits out of the column port values, indexed by port, and
+ * return them in ascending order. Note that this function hides the physical
+ * column wiring.
+ */
+static matrix_row_t
+col_decode(const uint32_t *idr)
+{
+    matrix_row_t c = 0;
+
+    MATRIX_COLS(COL_DECODE)
+
+    return c;
 }
 
 /*
  * col_read
  *
- * Read a column bits and return them in ascending order. Note that this
- * function hides the physical column wiring.
+ * Read the column bits of the currently selected row(s)
  */
-static uint16_t
+static matrix_row_t
 col_read(void)
 {
-    uint16_t c = (uint16_t)(GPIO_IDR(COLS_GPIO) & COLS_BV);
+    uint32_t idr[3] = { 0, 0, 0 };
+
+    if (COLS_MASK_A) {
+        idr[PORT_INDEX(GPIOA)] = GPIO_IDR(GPIOA);
+    }
+    if (COLS_MASK_B) {
+        idr[PORT_INDEX(GPIOB)] = GPIO_IDR(GPIOB);
+    }
+    if (COLS_MASK_C) {
+        idr[PORT_INDEX(GPIOC)] = GPIO_IDR(GPIOC);
+    }
 
-    return COLS_DECODE(c);
+    return col_decode(idr);
+}
+
+#if MATRIX_SCAN_DMA
+/*
+ * Hardware scan engine
+ *
+ * TIM2 runs at MATRIX_SCAN_HZ * ROWS_NUM. Every update event DMA1 channel 2
+ * (TIM2_UP) writes the BSRR pattern that selects the next row. Halfway the
+ * period, compare channel 1 makes DMA1 channel 5 (TIM2_CH1) copy the column
+ * port into scan_buffer. scan_buffer holds two frames of ROWS_NUM samples; the
+ * dma fills them in turn, and the cpu only reads the frame that was completed
+ * last, once one has completed since the engine was started. A frame is overwritten one frame time after it completed, if the
+ * main loop is slower than that it may see rows of two consecutive frames,
+ * which is harmless for the debouncer.
+ *
+ * The engine needs all rows on one port, and all columns on one port.
+ */
+#define PORT_COUNT(a, b, c)     (((a) != 0) + ((b) != 0) + ((c) != 0))
+
+#if (PORT_COUNT(ROWS_MASK_A, ROWS_MASK_B, ROWS_MASK_C) != 1) || \
+    (PORT_COUNT(COLS_MASK_A, COLS_MASK_B, COLS_MASK_C) != 1)
+#error MATRIX_SCAN_DMA needs all rows on one port and all columns on one port
+#endif
+
+#define ROWS_GPIO       (ROWS_MASK_A ? GPIOA : (ROWS_MASK_B ? GPIOB : GPIOC))
+#define ROWS_BV         (ROWS_MASK_A | ROWS_MASK_B | ROWS_MASK_C)
+#define COLS_GPIO       (COLS_MASK_A ? GPIOA : (COLS_MASK_B ? GPIOB : GPIOC))
+
+static uint32_t row_pattern[ROWS_NUM];
+static volatile uint32_t scan_buffer[2][ROWS_NUM];
+static bool scan_complete;
+
+/*
+ * scan_start
+ *
+ * Start scanning from the first row of the first frame
+ */
+static void
+scan_start(void)
+{
+    dma_set_number_of_data(DMA1, DMA_CHANNEL2, ROWS_NUM);
+    dma_set_number_of_data(DMA1, DMA_CHANNEL5, 2 * ROWS_NUM);
+    dma_clear_interrupt_flags(DMA1, DMA_CHANNEL5, DMA_HTIF | DMA_TCIF);
+    scan_complete = false;
+    dma_enable_channel(DMA1, DMA_CHANNEL2);
+    dma_enable_channel(DMA1, DMA_CHANNEL5);
+
+    /* the update event selects row 0 right away */
+    timer_set_counter(TIM2, 0);
+    timer_generate_event(TIM2, TIM_EGR_UG);
+    timer_enable_counter(TIM2);
+}
+
+/*
+ * scan_stop
+ *
+ * Stop the scan engine, leaves the rows in an undefined state.
+ */
+static void
+scan_stop(void)
+{
+    timer_disable_counter(TIM2);
+    dma_disable_channel(DMA1, DMA_CHANNEL2);
+    dma_disable_channel(DMA1, DMA_CHANNEL5);
+}
+
+/*
+ * scan_init
+ *
+ * Precompute the row patterns and set up the timer and dma channels.
+ */
+static void
+scan_init(void)
+{
+    uint32_t period = (rcc_apb1_frequency * 2) / (MATRIX_SCAN_HZ * ROWS_NUM);
+    uint8_t r;
+
+    for (r = 0; r < ROWS_NUM; r++) {
+        row_pattern[r] = row_pins[r].bit | ((ROWS_BV & ~row_pins[r].bit) << 16);
+    }
+
+    rcc_periph_clock_enable(RCC_DMA1);
+    rcc_periph_clock_enable(RCC_TIM2);
+    rcc_periph_reset_pulse(RST_TIM2);
+
+    timer_set_mode(TIM2, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+    timer_set_prescaler(TIM2, 0);
+    timer_set_period(TIM2, period - 1);
+    timer_set_oc_value(TIM2, TIM_OC1, period / 2);
+    timer_enable_irq(TIM2, TIM_DIER_UDE | TIM_DIER_CC1DE);
+
+    dma_channel_reset(DMA1, DMA_CHANNEL2);
+    dma_set_peripheral_address(DMA1, DMA_CHANNEL2, (uint32_t)&GPIO_BSRR(ROWS_GPIO));
+    dma_set_memory_address(DMA1, DMA_CHANNEL2, (uint32_t)row_pattern);
+    dma_set_read_from_memory(DMA1, DMA_CHANNEL2);
+    dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL2);
+    dma_set_peripheral_size(DMA1, DMA_CHANNEL2, DMA_CCR_PSIZE_32BIT);
+    dma_set_memory_size(DMA1, DMA_CHANNEL2, DMA_CCR_MSIZE_32BIT);
+    dma_set_priority(DMA1, DMA_CHANNEL2, DMA_CCR_PL_VERY_HIGH);
+    dma_enable_circular_mode(DMA1, DMA_CHANNEL2);
+
+    dma_channel_reset(DMA1, DMA_CHANNEL5);
+    dma_set_peripheral_address(DMA1, DMA_CHANNEL5, (uint32_t)&GPIO_IDR(COLS_GPIO));
+    dma_set_memory_address(DMA1, DMA_CHANNEL5, (uint32_t)scan_buffer);
+    dma_set_read_from_peripheral(DMA1, DMA_CHANNEL5);
+    dma_enable_memory_increment_mode(DMA1, DMA_CHANNEL5);
+    dma_set_peripheral_size(DMA1, DMA_CHANNEL5, DMA_CCR_PSIZE_32BIT);
+    dma_set_memory_size(DMA1, DMA_CHANNEL5, DMA_CCR_MSIZE_32BIT);
+    dma_set_priority(DMA1, DMA_CHANNEL5, DMA_CCR_PL_VERY_HIGH);
+    dma_enable_circular_mode(DMA1, DMA_CHANNEL5);
+
+    scan_start();
+}
+
+/*
+ * scan_frame
+ *
+ * Return the frame that the dma completed last, or NULL if no frame has
+ * been completed since scan_start; the buffer then still holds the frames
+ * from before. The half and full transfer flags tell when the first frame
+ * is in, the remaining transfer count tells which frame is being filled now.
+ */
+static const volatile uint32_t *
+scan_frame(void)
+{
+    if (!scan_complete) {
+        if (!dma_get_interrupt_flag(DMA1, DMA_CHANNEL5, DMA_HTIF | DMA_TCIF)) {
+            return NULL;
+        }
+        scan_complete = true;
+    }
+    if (DMA_CNDTR(DMA1, DMA_CHANNEL5) > ROWS_NUM) {
+        return scan_buffer[1];
+    }
+    return scan_buffer[0];
+}
+
+/*
+ * scan_decode
+ *
+ * Decode a column port value sampled by the scan engine
+ */
+static matrix_row_t
+scan_decode(uint32_t sample)
+{
+    uint32_t idr[3] = { 0, 0, 0 };
+
+    idr[PORT_INDEX(COLS_GPIO)] = sample;
+    return col_decode(idr);
+}
+#endif
+
+/*
+ * idle_init
+ *
+ * Route the column pins to their EXTI lines, and enable the interrupts that
+ * serve those lines. The lines themselves are only armed when idle.
+ */
+static void
+idle_init(void)
+{
+    uint8_t pin;
+    uint8_t irq;
+
+    rcc_periph_clock_enable(RCC_AFIO);
+    if (COLS_MASK_A) {
+        exti_select_source(COLS_MASK_A, GPIOA);
+    }
+    if (COLS_MASK_B) {
+        exti_select_source(COLS_MASK_B, GPIOB);
+    }
+    if (COLS_MASK_C) {
+        exti_select_source(COLS_MASK_C, GPIOC);
+    }
+    exti_set_trigger(COLS_MASK, EXTI_TRIGGER_RISING);
+    exti_disable_request(COLS_MASK);
+
+    for (pin = 0; pin < 16; pin++) {
+        if (COLS_MASK & (1 << pin)) {
+            if (pin < 5) {
+                irq = NVIC_EXTI0_IRQ + pin;
+            } else if (pin < 10) {
+                irq = NVIC_EXTI9_5_IRQ;
+            } else {
+                irq = NVIC_EXTI15_10_IRQ;
+            }
+            nvic_enable_irq(irq);
+        }
+    }
+
+    dwt_enable_cycle_counter();
+    matrix_idle = false;
+    idle_timer = timer_set(MS_IDLE);
+}
+
+/*
+ * idle_wake
+ *
+ * Leave idle mode; called from the column interrupts. Scanning resumes on
+ * the next pass of the main loop, with a full MS_IDLE before idle mode can
+ * be entered again.
+ */
+static void
+idle_wake(void)
+{
+    exti_disable_request(COLS_MASK);
+    exti_reset_request(COLS_MASK);
+
+    if (matrix_idle) {
+        row_clear();
+#if MATRIX_SCAN_DMA
+        scan_start();
+#endif
+        idle_timer = timer_set(MS_IDLE);
+        idle_wake_cycles = dwt_read_cycle_counter();
+        idle_woken = true;
+        matrix_idle = false;
+    }
+}
+
+/*
+ * idle_enter
+ *
+ * Drive all rows and arm the column interrupts. A key that is pressed while
+ * arming is caught by reading the columns afterwards.
+ */
+static void
+idle_enter(void)
+{
+#if MATRIX_SCAN_DMA
+    scan_stop();
+#endif
+    row_all();
+    exti_reset_request(COLS_MASK);
+    idle_start = clock_now();
+    matrix_idle = true;
+    PROFILE_PAUSE();
+    exti_enable_request(COLS_MASK);
+
+    if (col_read()) {
+        idle_wake();
+    }
+}
+
+/*
+ * matrix_sleep
+ *
+ * Sleep until the next interrupt if the matrix is idle. Interrupts are
+ * masked while checking, so a wake up that arrives just before the wfi is
+ * not lost; it ends the wfi right away.
+ */
+void
+matrix_sleep(void)
+{
+    cm_disable_interrupts();
+    if (matrix_idle) {
+        __asm__ volatile ("wfi");
+        PROFILE_PAUSE();
+    }
+    cm_enable_interrupts();
+}
+
+void exti0_isr(void) { idle_wake(); }
+void exti1_isr(void) { idle_wake(); }
+void exti2_isr(void) { idle_wake(); }
+void exti3_isr(void) { idle_wake(); }
+void exti4_isr(void) { idle_wake(); }
+void exti9_5_isr(void) { idle_wake(); }
+void exti15_10_isr(void) { idle_wake(); }
+
+/*
+ * port_init
+ *
+ * Setup the row and column pins of a single port
+ */
+static void
+port_init(uint32_t port, enum rcc_periph_clken rcc, uint16_t rows, uint16_t cols)
+{
+    if (rows | cols) {
+        rcc_periph_clock_enable(rcc);
+    }
+    if (rows) {
+        gpio_set_mode(port, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, rows);
+    }
+    if (cols) {
+        gpio_set_mode(port, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, cols);
+    }
 }
 
 /*
@@ -98,88 +549,250 @@ col_read(void)
 void
 matrix_init(void)
 {
-    uint8_t i;
+    port_init(GPIOA, RCC_GPIOA, ROWS_MASK_A, COLS_MASK_A);
+    port_init(GPIOB, RCC_GPIOB, ROWS_MASK_B, COLS_MASK_B);
+    port_init(GPIOC, RCC_GPIOC, ROWS_MASK_C, COLS_MASK_C);
 
-    rcc_periph_clock_enable(ROWS_RCC);
-    rcc_periph_clock_enable(COLS_RCC);
-    gpio_set_mode(ROWS_GPIO, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, ROWS_BV);
-    gpio_set_mode(COLS_GPIO, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, COLS_BV);
+    row_clear();
+    idle_init();
+#if MATRIX_SCAN_DMA
+    scan_init();
+#endif
+
+    memset(&matrix, 0, sizeof(matrix));
+    memset(&matrix_previous, 0, sizeof(matrix_previous));
+    memset(&matrix_pending, 0, sizeof(matrix_pending));
+    debounce_init();
+    matrix_set_debounce(DEBOUNCE_MODE);
+}
+
+/*
+ * matrix_set_debounce
+ *
+ * Select the debounce strategy. Keys that are still being debounced are
+ * restarted under the new strategy.
+ */
+void
+matrix_set_debounce(uint8_t mode)
+{
+    if (mode >= DEBOUNCE_MAX) {
+        elog("unknown debounce mode %d", mode);
+        return;
+    }
+
+    debounce_mode = mode;
+    debounce_reset();
+    debounce_tick = clock_now();
+}
+
+/*
+ * scan_any
+ *
+ * Check whether any key is down, by driving all rows at once and reading the
+ * columns a single time.
+ */
+static bool
+scan_any(void)
+{
+#if MATRIX_SCAN_DMA
+    const volatile uint32_t *frame = scan_frame();
+    uint32_t idr = 0;
+    uint8_t r;
+
+    for (r = 0; r < ROWS_NUM; r++) {
+        idr |= frame[r];
+    }
+    return (scan_decode(idr) != 0);
+#else
+    matrix_row_t col;
 
+    row_all();
+    col = col_read();
     row_clear();
+    return (col != 0);
+#endif
+}
 
-    for (i = 0; i < ROWS_NUM; i++) {
-        matrix.row[i] = 0;
-        matrix_debounce.row[i] = 0;
-        matrix_previous.row[i] = 0;
+/*
+ * scan_rows
+ *
+ * Read every row into a bitboard and debounce it. Returns non zero if any
+ * key is down, being debounced or being watched for bounce.
+ */
+static uint32_t
+scan_rows(uint32_t now, bool tick)
+{
+    uint8_t r, w;
+    uint32_t raw[MATRIX_WORDS];
+    uint32_t active = 0;
+#if MATRIX_SCAN_DMA
+    const volatile uint32_t *frame = scan_frame();
+#endif
+
+    memset(raw, 0, sizeof(raw));
+
+    /* ROWS_NUM is constant, so let the compiler unroll the row walk */
+#pragma GCC unroll 16
+    for (r = 0; r < ROWS_NUM; r++) {
+#if MATRIX_SCAN_DMA
+        raw[ROW_WORD(r)] |= (scan_decode(frame[r]) << ROW_SHIFT(r));
+#else
+        row_select(r);
+        raw[ROW_WORD(r)] |= (col_read() << ROW_SHIFT(r));
+        row_clear();
+#endif
     }
+
+    for (w = 0; w < MATRIX_WORDS; w++) {
+        active |= debounce_word(w, raw[w], now, tick);
+    }
+
+    return active;
 }
 
 /*
  * matrix_scan
  *
- * Read the matrix; select each row, and read column value. Debounce by quickly
- * noting the current value, and only taking that value after it has been
- * stable for DEBOUNCE ms.
+ * Read the matrix; select each row, and read column value. Each key is
+ * debounced on its own, using the strategy selected in debounce_mode. With
+ * MATRIX_SCAN_DMA the rows have already been read by the scan engine, and
+ * only the last completed frame is debounced; nothing is done until the
+ * engine completed its first frame after a start.
+ *
+ * If the previous scan found nothing to do, all rows are checked in one go
+ * first, and the row by row walk is only done if a key is down.
  */
 void
 matrix_scan()
 {
-    uint8_t r;
-    uint16_t col;
+    uint32_t now;
+    uint32_t cycles;
+    bool tick;
 
-    for (r = 0; r < ROWS_NUM; r++) {
-        row_select(r);
-        col = col_read();
-        if (matrix_debounce.row[r] != col) {
-            matrix_debounce.row[r] = col;
-            matrix_update = true;
-            debounce = timer_set(MS_DEBOUNCE);
+    if (matrix_idle) {
+        return;
+    }
+#if MATRIX_SCAN_DMA
+    if (!scan_frame()) {
+        return;
+    }
+#endif
+
+    PROFILE_SCAN();
+    cycles = dwt_read_cycle_counter();
+    now = clock_now();
+    tick = (now != debounce_tick);
+    debounce_tick = now;
+
+    if (idle_woken) {
+        /* first scan after a wake up */
+        wake_cycles_last = cycles - idle_wake_cycles;
+        if (wake_cycles_last > wake_cycles_max) {
+            wake_cycles_max = wake_cycles_last;
         }
-        row_clear();
+        idle_woken = false;
+        idle_ms += now - idle_start;
+        idle_count++;
+    }
+
+    if (scan_active || scan_any()) {
+        scan_active = scan_rows(now, tick);
+        scan_full_count++;
+        scan_full_cycles += dwt_read_cycle_counter() - cycles;
+    } else {
+        scan_fast_count++;
+        scan_fast_cycles += dwt_read_cycle_counter() - cycles;
+    }
+
+    if (scan_active) {
+        idle_timer = timer_set(MS_IDLE);
+    } else if (timer_passed(idle_timer)) {
+        idle_enter();
+    }
+}
+
+/*
+ * matrix_push
+ *
+ * Queue key up/down events for the keys in keys that changed since the
+ * previous scan state, lowest key first, all with the scan time time_us.
+ * Returns false if the queue filled up; keys then holds the keys that were
+ * not queued yet.
+ */
+static bool
+matrix_push(matrix_t *keys, uint32_t time_us)
+{
+    uint32_t changed, bit;
+    uint16_t k;
+    uint8_t w;
+
+    for (w = 0; w < MATRIX_WORDS; w++) {
+        keys->word[w] &= matrix.word[w] ^ matrix_previous.word[w];
     }
 
-    if (matrix_update && timer_passed(debounce)) {
-        matrix_update = false;
-        for (r = 0; r < ROWS_NUM; r++) {
-            matrix.row[r] = matrix_debounce.row[r];
+    for (w = 0; w < MATRIX_WORDS; w++) {
+        changed = keys->word[w];
+        while (changed) {
+            k = __builtin_ctz(changed);
+            bit = (1U << k);
+            changed &= ~bit;
+            k += w * 32;
+            if (!queue_push(MATRIX_ROW(k), MATRIX_COL(k), matrix.word[w] & bit, time_us)) {
+                return false;
+            }
+            matrix_previous.word[w] ^= bit;
+            keys->word[w] &= ~bit;
         }
     }
+
+    return true;
 }
 
 /*
  * matrix_process
  *
  * Generate key up/down events depending on the current and previous scan
- * state.
+ * state, and queue them for the keymap with the time of the scan. Events
+ * that do not fit in the queue are kept in matrix_pending with the time of
+ * their scan. The matrix is not scanned again until they are queued, so
+ * every event carries the time of the scan that saw it.
  */
 void
 matrix_process()
 {
-    uint8_t r, c;
-    uint16_t col, colbit;
+    uint32_t now_us;
+
+    if (!matrix_push(&matrix_pending, matrix_pending_us)) {
+        return;
+    }
 
     /* Make sure that we pick up new scan events */
     matrix_scan();
+    now_us = clock_now_us();
+
+    if (show_matrix && memcmp(&matrix, &matrix_previous, sizeof(matrix))) {
+        matrix_debug();
+    }
 
     /*
      * Check for scan events, even if the previous matrix scan returned
      * nothing. We might still have some unprocessed events in our previous
      * matrix.
      */
+    memset(&matrix_pending, 0xff, sizeof(matrix_pending));
+    matrix_pending_us = now_us;
+    matrix_push(&matrix_pending, now_us);
+}
 
-    for (r = 0; r < ROWS_NUM; r++) {
-        col = matrix.row[r] ^ matrix_previous.row[r];
-        if (col) {
-            for (c = 0; c < COLS_NUM; c++) {
-                colbit = (1 << c);
-                if (col & colbit) {
-                    if (show_matrix) matrix_debug();
-                    keymap_event(r, c, matrix.row[r] & colbit);
-                    matrix_previous.row[r] ^= colbit;
-                }
-            }
-        }
-    }
+/*
+ * matrix_get_row
+ *
+ * Return the keys that are down in a row, by column
+ */
+static matrix_row_t
+matrix_get_row(const matrix_t *m, uint8_t r)
+{
+    return (m->word[ROW_WORD(r)] >> ROW_SHIFT(r)) & ROW_MASK;
 }
 
 /*
@@ -193,6 +806,61 @@ matrix_debug(void)
     uint8_t i;
 
     for (i = 0; i < ROWS_NUM; i++) {
-        printf("%02x :%02x\n", i, (unsigned int) matrix.row[i]);
+        printf("%02x :%02x\n", i, (unsigned int) matrix_get_row(&matrix, i));
+    }
+}
+
+/*
+ * matrix_stats
+ *
+ * Emit the scan cost and idle mode counters; time spent idle and the time
+ * between a key waking the matrix and the first scan after that. Also emits
+ * the key event queue counters.
+ */
+void
+matrix_stats(void)
+{
+    uint32_t cycles_us = rcc_ahb_frequency / 1000000;
+    uint32_t fast = 0, full = 0;
+
+    if (scan_fast_count) {
+        fast = (uint32_t)(scan_fast_cycles / scan_fast_count);
+    }
+    if (scan_full_count) {
+        full = (uint32_t)(scan_full_cycles / scan_full_count);
+    }
+
+#if MATRIX_SCAN_DMA
+    printfnl("dma scan %d Hz", MATRIX_SCAN_HZ);
+#endif
+    printfnl("fast scans %d, %d cycles avg", scan_fast_count, fast);
+    printfnl("full scans %d, %d cycles avg", scan_full_count, full);
+    if (full > fast) {
+        printfnl("saved %d kcycles", (uint32_t)(((uint64_t)scan_fast_count * (full - fast)) / 1000));
+    }
+    printfnl("idle %d times, %d ms", idle_count, idle_ms);
+    printfnl("wake latency last %d us, max %d us",
+             wake_cycles_last / cycles_us,
+             wake_cycles_max / cycles_us);
+    queue_stats();
+}
+
+/*
+ * matrix_dump_debounce
+ *
+ * Emit the debounce window in ms of every key
+ */
+void
+matrix_dump_debounce(void)
+{
+    uint8_t r, c;
+
+    printfnl("debounce mode %d", debounce_mode);
+    for (r = 0; r < ROWS_NUM; r++) {
+        printf("row %02x: ", r);
+        for (c = 0; c < COLS_NUM; c++) {
+            printf("%02d ", debounce_ms[(r * COLS_NUM) + c]);
+        }
+        printf("\n");
     }
 }
@@ -31,16 +31,56 @@
 
 typedef uint32_t matrix_row_t;
 
+/*
+ * The matrix state is a bitboard; key (row, col) is bit MATRIX_BIT(row, col).
+ * Rows are packed back to back when all keys fit in a single word. Larger
+ * matrices start each row at a power of two, so a row never straddles two
+ * words.
+ */
+#if (ROWS_NUM * COLS_NUM) <= 32
+#define MATRIX_STRIDE   COLS_NUM
+#elif COLS_NUM <= 8
+#define MATRIX_STRIDE   8
+#elif COLS_NUM <= 16
+#define MATRIX_STRIDE   16
+#else
+#define MATRIX_STRIDE   32
+#endif
+
+#define MATRIX_WORDS            (((ROWS_NUM * MATRIX_STRIDE) + 31) / 32)
+#define MATRIX_BIT(row, col)    (((row) * MATRIX_STRIDE) + (col))
+#define MATRIX_ROW(bit)         ((bit) / MATRIX_STRIDE)
+#define MATRIX_COL(bit)         ((bit) % MATRIX_STRIDE)
+
 typedef struct {
-    matrix_row_t row[ROWS_NUM];
+    uint32_t word[MATRIX_WORDS];
 } matrix_t;
 
+/*
+ * Storage for a byte per key, rounded up to whole words so it can be
+ * written to flash.
+ */
+#define DEBOUNCE_KEYS   (((ROWS_NUM * COLS_NUM) + 3) & ~3)
+
+enum {
+    DEBOUNCE_DEFER = 0,
+    DEBOUNCE_EAGER,
+    DEBOUNCE_MAX
+};
+
 extern matrix_t matrix;
+extern uint8_t debounce_mode;
+extern uint8_t debounce_ms[DEBOUNCE_KEYS];
 
 void matrix_init(void);
 void matrix_scan(void);
 void matrix_process(void);
 void matrix_event(uint16_t row, uint16_t col, bool pressed);
 void matrix_debug(void);
+void matrix_set_debounce(uint8_t mode);
+void matrix_load_debounce(void);
+void matrix_stats(void);
+void matrix_sleep(void);
+void matrix_dump_debounce(void);
 
 #endif /* _MATRIX_H */
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * override
+ *
+ * Key overrides, e.g. shift+backspace sending delete. override_index holds,
+ * per keycode, the first override for that key, and override_next chains
+ * the others; keys without an override cost a single lookup. The trigger
+ * and suppress masks are folded into both modifier sides once, when the
+ * table changes.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "elog.h"
+#include "keyboard.h"
+#include "keymap.h"
+#include "override.h"
+#include "serial.h"
+
+#if OVERRIDE_NUM > 255
+#error OVERRIDE_NUM must fit in an override index
+#endif
+
+/* fold left and right modifiers into both sides */
+#define OVERRIDE_SIDES(m)   ((((m) | ((m) >> 4)) & 0x0f) * 0x11)
+
+override_t overrides[OVERRIDE_NUM];
+
+/* entries are override number + 1, 0 ends a chain */
+static uint8_t override_index[256];
+static uint8_t override_next[OVERRIDE_NUM];
+static uint8_t override_trigger[OVERRIDE_NUM];
+static uint8_t override_suppress[OVERRIDE_NUM];
+
+/*
+ * override_init
+ *
+ * Index the override table, i.e. after it has been read from flash
+ */
+void
+override_init(void)
+{
+    uint8_t i, key;
+
+    memset(override_index, 0, sizeof(override_index));
+    memset(override_next, 0, sizeof(override_next));
+
+    for (i = OVERRIDE_NUM; i-- > 0; ) {
+        key = overrides[i].key;
+        if (!key) {
+            continue;
+        }
+        override_trigger[i] = OVERRIDE_SIDES(overrides[i].trigger);
+        override_suppress[i] = OVERRIDE_SIDES(overrides[i].suppress ?
+                                              overrides[i].suppress :
+                                              overrides[i].trigger);
+        override_next[i] = override_index[key];
+        override_index[key] = i + 1;
+    }
+}
+
+/*
+ * override_match
+ *
+ * Return the event that overrides a key event under the live modifiers,
+ * and the modifiers to suppress for it; or 0 if there is none.
+ */
+const event_t *
+override_match(const event_t *event, uint8_t *suppress)
+{
+    uint8_t i = override_index[event->key.code];
+    uint8_t mods;
+
+    if (!i) {
+        return 0;
+    }
+
+    mods = OVERRIDE_SIDES(keyboard_get_mods());
+    for (; i; i = override_next[i - 1]) {
+        if ((mods & override_trigger[i - 1]) == override_trigger[i - 1]) {
+            *suppress = override_suppress[i - 1];
+            return &overrides[i - 1].event;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * override_set
+ *
+ * Set override number, a key of 0 removes it
+ */
+void
+override_set(uint8_t number, override_t *override)
+{
+    if (number >= OVERRIDE_NUM) {
+        elog("override number out of bounds");
+        return;
+    }
+
+    if (override->key && !override->trigger) {
+        elog("override needs a trigger");
+        return;
+    }
+
+    overrides[number] = *override;
+    override_init();
+}
+
+/*
+ * override_dump
+ *
+ * Emit every defined override, as its key, masks and event
+ */
+void
+override_dump(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < OVERRIDE_NUM; i++) {
+        if (!overrides[i].key) {
+            continue;
+        }
+        printf("override %02x: %02x %02x/%02x -> %01x,%02x%02x%02x\n\r",
+               i,
+               overrides[i].key,
+               overrides[i].trigger,
+               overrides[i].suppress,
+               overrides[i].event.type,
+               overrides[i].event.args.num1,
+               overrides[i].event.args.num2,
+               overrides[i].event.args.num3);
+    }
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * profile
+ *
+ * Measure how often the matrix is scanned and how long a pass of the main
+ * loop takes, using the DWT cycle counter. Only built with PROFILE set.
+ */
+#include <string.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "config.h"
+#include "profile.h"
+#include "serial.h"
+
+#if PROFILE
+
+/*
+ * Main loop histogram: bucket 0 counts passes under 1 us, bucket b counts
+ * passes of 2^(b-1) up to 2^b us. The last bucket takes everything longer.
+ */
+#define PROFILE_BUCKETS 16
+
+static uint32_t scan_last;
+static uint32_t scan_count;
+static uint32_t scan_min;
+static uint32_t scan_max;
+static uint64_t scan_total;
+
+static uint32_t loop_last;
+static uint32_t loop_count;
+static uint32_t loop_max;
+static uint32_t loop_histogram[PROFILE_BUCKETS];
+
+/*
+ * profile_reset
+ *
+ * Restart all measurements
+ */
+static void
+profile_reset(void)
+{
+    scan_last = loop_last = 0;
+    scan_count = loop_count = 0;
+    scan_min = UINT32_MAX;
+    scan_max = loop_max = 0;
+    scan_total = 0;
+    memset(loop_histogram, 0, sizeof(loop_histogram));
+}
+
+/*
+ * profile_init
+ *
+ * Start the cycle counter and clear all measurements
+ */
+void
+profile_init(void)
+{
+    dwt_enable_cycle_counter();
+    profile_reset();
+}
+
+/*
+ * profile_scan
+ *
+ * Called at the start of every matrix scan; measures the time since the
+ * previous scan.
+ */
+void
+profile_scan(void)
+{
+    uint32_t now = dwt_read_cycle_counter();
+    uint32_t cycles = now - scan_last;
+
+    if (scan_last) {
+        scan_count++;
+        scan_total += cycles;
+        if (cycles < scan_min) {
+            scan_min = cycles;
+        }
+        if (cycles > scan_max) {
+            scan_max = cycles;
+        }
+    }
+    scan_last = now | 1;
+}
+
+/*
+ * profile_pause
+ *
+ * Scanning stops for a while, i.e. the matrix goes idle and the core
+ * sleeps. The gap until the next scan and the next loop is not counted.
+ */
+void
+profile_pause(void)
+{
+    scan_last = loop_last = 0;
+}
+
+/*
+ * profile_loop
+ *
+ * Called once per pass of the main loop; adds the time since the previous
+ * pass to the histogram.
+ */
+void
+profile_loop(void)
+{
+    uint32_t now = dwt_read_cycle_counter();
+    uint32_t us;
+    uint8_t b;
+
+    if (loop_last) {
+        us = (now - loop_last) / (rcc_ahb_frequency / 1000000);
+        b = us ? (32 - __builtin_clz(us)) : 0;
+        if (b >= PROFILE_BUCKETS) {
+            b = PROFILE_BUCKETS - 1;
+        }
+        loop_histogram[b]++;
+        loop_count++;
+        if (us > loop_max) {
+            loop_max = us;
+        }
+    }
+    loop_last = now | 1;
+}
+
+/*
+ * profile_dump
+ *
+ * Emit the scan rate, the time between scans and the main loop histogram,
+ * then restart all measurements.
+ */
+void
+profile_dump(void)
+{
+    uint32_t cycles_us = rcc_ahb_frequency / 1000000;
+    uint32_t rate = 0, avg = 0;
+    uint8_t b;
+
+    if (scan_count) {
+        rate = (uint32_t)(((uint64_t)scan_count * rcc_ahb_frequency) / scan_total);
+        avg = (uint32_t)(scan_total / scan_count);
+    } else {
+        scan_min = 0;
+    }
+
+    printfnl("scans %d, %d per s", scan_count, rate);
+    printfnl("scan interval min %d, avg %d, max %d cycles", scan_min, avg, scan_max);
+    printfnl("scan interval min %d, avg %d, max %d us",
+             scan_min / cycles_us, avg / cycles_us, scan_max / cycles_us);
+    printfnl("loops %d, max %d us", loop_count, loop_max);
+    for (b = 0; b < (PROFILE_BUCKETS - 1); b++) {
+        if (loop_histogram[b]) {
+            printfnl("loop < %d us: %d", 1 << b, loop_histogram[b]);
+        }
+    }
+    if (loop_histogram[b]) {
+        printfnl("loop >= %d us: %d", 1 << (b - 1), loop_histogram[b]);
+    }
+
+    profile_reset();
+}
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * queue
+ *
+ * Fixed size queue of timestamped key events, from the matrix scanner to
+ * the keymap. There is a single producer and a single consumer; the
+ * producer only writes queue_head and the consumer only writes queue_tail,
+ * so no locking is needed. A full queue refuses new events and counts them
+ * as overflows, it never blocks the producer.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "queue.h"
+#include "serial.h"
+
+#if (QUEUE_SIZE & (QUEUE_SIZE - 1)) != 0
+#error QUEUE_SIZE must be a power of two
+#endif
+
+static keyevent_t queue[QUEUE_SIZE];
+static volatile uint32_t queue_head;
+static volatile uint32_t queue_tail;
+static uint32_t queue_overflow;
+static uint32_t queue_depth_max;
+
+/*
+ * queue_init
+ *
+ * Drop all events
+ */
+void
+queue_init(void)
+{
+    queue_head = queue_tail = 0;
+    queue_overflow = queue_depth_max = 0;
+}
+
+/*
+ * queue_push
+ *
+ * Add an event to the queue. Returns false, and counts an overflow, if the
+ * queue is full.
+ */
+bool
+queue_push(uint8_t row, uint8_t col, bool pressed, uint32_t timestamp_us)
+{
+    uint32_t head = queue_head;
+    uint32_t depth = head - queue_tail;
+    keyevent_t *event;
+
+    if (depth >= QUEUE_SIZE) {
+        queue_overflow++;
+        return false;
+    }
+
+    event = &queue[head & (QUEUE_SIZE - 1)];
+    event->row = row;
+    event->col = col;
+    event->pressed = pressed;
+    event->combo = 0;
+    event->timestamp_us = timestamp_us;
+
+    /* publish the event only after it has been written */
+    __sync_synchronize();
+    queue_head = head + 1;
+
+    if (depth + 1 > queue_depth_max) {
+        queue_depth_max = depth + 1;
+    }
+
+    return true;
+}
+
+/*
+ * queue_pop
+ *
+ * Take the oldest event off the queue. Returns false if the queue is empty.
+ */
+bool
+queue_pop(keyevent_t *event)
+{
+    uint32_t tail = queue_tail;
+
+    if (tail == queue_head) {
+        return false;
+    }
+
+    __sync_synchronize();
+    *event = queue[tail & (QUEUE_SIZE - 1)];
+    __sync_synchronize();
+    queue_tail = tail + 1;
+
+    return true;
+}
+
+/*
+ * queue_stats
+ *
+ * Emit the queue depth and overflow counters
+ */
+void
+queue_stats(void)
+{
+    printfnl("queue %d/%d, max %d, overflows %d",
+             queue_head - queue_tail, QUEUE_SIZE,
+             queue_depth_max, queue_overflow);
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tapdance
+ *
+ * Tap-dance keys count their taps. Every tap arms a deadline; when it
+ * passes, or another key is pressed, the count decides the action. A tap
+ * that reaches the last action of the key decides at once. If the key is
+ * still down when the action is decided, the action is held until the key
+ * is released, otherwise it is tapped.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "deadline.h"
+#include "elog.h"
+#include "keymap.h"
+#include "serial.h"
+#include "tapdance.h"
+
+tapdance_t tapdances[TAPDANCE_NUM];
+
+static struct {
+    uint8_t number;
+    uint8_t count;
+    event_t *latched;   /* the event the key is down with, or 0 */
+} tapdance;
+
+/*
+ * tapdance_taps
+ *
+ * Return the number of taps a tap-dance key counts up to
+ */
+static uint8_t
+tapdance_taps(uint8_t number)
+{
+    uint8_t taps = TAPDANCE_TAPS;
+
+    while (taps && (tapdances[number].tap[taps - 1].type == KMT_NONE)) {
+        taps--;
+    }
+
+    return taps;
+}
+
+/*
+ * tapdance_decide
+ *
+ * Act on the taps counted so far. A key that is still down latches the
+ * action, so the release of the key releases it.
+ */
+static void
+tapdance_decide(void)
+{
+    event_t action = tapdances[tapdance.number].tap[tapdance.count - 1];
+
+    tapdance.count = 0;
+    deadline_cancel(DEADLINE_TAPDANCE);
+
+    if (tapdance.latched) {
+        *tapdance.latched = action;
+        tapdance.latched = 0;
+        keymap_dispatch(&action, true);
+    } else {
+        keymap_dispatch(&action, true);
+        keymap_dispatch(&action, false);
+    }
+}
+
+/*
+ * tapdance_expire
+ *
+ * No next tap came within the term
+ */
+static void
+tapdance_expire(uint32_t at_us)
+{
+    (void)at_us;
+
+    if (tapdance.count) {
+        tapdance_decide();
+    }
+}
+
+/*
+ * tapdance_event
+ *
+ * Count a press of a tap-dance key; event is where the key latched it
+ */
+void
+tapdance_event(event_t *event, bool pressed, uint32_t now_us)
+{
+    uint8_t number = event->tapdance.number;
+
+    if (!pressed) {
+        if (event == tapdance.latched) {
+            /* only the key that counts the taps stops being held */
+            tapdance.latched = 0;
+        }
+        return;
+    }
+
+    if (number >= TAPDANCE_NUM) {
+        elog("tapdance number out of bounds");
+        return;
+    }
+
+    if (tapdance.count && (tapdance.number != number)) {
+        tapdance_decide();
+    }
+
+    if (!tapdance_taps(number)) {
+        return;
+    }
+
+    tapdance.number = number;
+    tapdance.latched = event;
+    if (++tapdance.count == tapdance_taps(number)) {
+        /* no more taps can follow, so there is nothing to wait for */
+        tapdance_decide();
+        return;
+    }
+
+    deadline_set(DEADLINE_TAPDANCE, now_us + (MS_TAPDANCE_TERM * 1000),
+                 tapdance_expire);
+}
+
+/*
+ * tapdance_interrupt
+ *
+ * Another key is pressed; decide on the taps so far before it acts
+ */
+void
+tapdance_interrupt(void)
+{
+    if (tapdance.count) {
+        tapdance_decide();
+    }
+}
+
+/*
+ * tapdance_set
+ *
+ * Set the action of tap-dance key number for a number of taps
+ */
+void
+tapdance_set(uint8_t number, uint8_t tap, event_t *event)
+{
+    if ((number >= TAPDANCE_NUM) || (tap < 1) || (tap > TAPDANCE_TAPS)) {
+        elog("tapdance out of bounds");
+        return;
+    }
+
+    if (event->type == KMT_TAPDANCE) {
+        elog("tapdance cannot tap a tapdance");
+        return;
+    }
+
+    tapdances[number].tap[tap - 1] = *event;
+}
+
+/*
+ * tapdance_dump
+ *
+ * Emit the actions of every tap-dance key that has them
+ */
+void
+tapdance_dump(void)
+{
+    event_t *e;
+    uint8_t i, t;
+
+    for (i = 0; i < TAPDANCE_NUM; i++) {
+        if (!tapdance_taps(i)) {
+            continue;
+        }
+        printf("tapdance %02x:", i);
+        for (t = 0; t < TAPDANCE_TAPS; t++) {
+            e = &tapdances[i].tap[t];
+            printf(" %01x,%02x%02x%02x", e->type,
+                   e->args.num1, e->args.num2, e->args.num3);
+        }
+        printf("\n\r");
+    }
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host test of the per key debounce
+ *
+ * Keys that bounce are fed through debounce_word a ms at a time, the same
+ * way matrix_scan does, and the ms at which every transition is committed
+ * to the matrix is checked for the deferred and the eager strategy. The
+ * keys of a test are run together, so a key that bounces must not delay
+ * the others.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../config.h"
+#include "../debounce.h"
+#include "../matrix.h"
+
+#define TEST_MS         100
+#define TEST_EDGES      8
+#define TEST_KEYS       4
+
+matrix_t matrix;
+
+typedef struct {
+    uint8_t row;
+    uint8_t col;
+    uint8_t edges[TEST_EDGES];      /* ms at which the switch flips */
+    uint8_t commits[TEST_EDGES];    /* ms at which the matrix should flip */
+} key_test_t;
+
+typedef struct {
+    const char *name;
+    uint8_t mode;
+    key_test_t keys[TEST_KEYS];
+} debounce_test_t;
+
+/* lists of ms end at the first 0, so nothing happens at ms 0 */
+#define W MS_DEBOUNCE
+
+static const debounce_test_t tests[] = {
+    { "defer", DEBOUNCE_DEFER, {
+        /* clean press and release */
+        { 0, 0, { 1, 40 }, { 1 + W, 40 + W } },
+        /* bounces; commit a window after the last edge */
+        { 1, 2, { 3, 4, 5, 6, 7, 60, 61, 62 }, { 7 + W, 62 + W } },
+        /* never stable for a window until the last edge */
+        { 4, 4, { 20, 25, 28 }, { 28 + W } },
+        /* pressed while the others bounce */
+        { 2, 1, { 5, 70 }, { 5 + W, 70 + W } },
+    } },
+    { "eager", DEBOUNCE_EAGER, {
+        { 0, 0, { 1, 40 }, { 1, 40 } },
+        /* commit on the first edge, the bounce after it is ignored */
+        { 1, 2, { 3, 4, 5, 6, 7, 60, 61, 62 }, { 3, 60 } },
+        /* the release within the window is taken for bounce */
+        { 4, 4, { 20, 25, 28 }, { 20 } },
+        { 2, 1, { 5, 70 }, { 5, 70 } },
+    } },
+};
+
+/*
+ * key_raw
+ *
+ * Return whether the switch of a key is closed at ms t
+ */
+static bool
+key_raw(const key_test_t *key, uint8_t t)
+{
+    bool closed = false;
+    uint8_t i;
+
+    for (i = 0; (i < TEST_EDGES) && key->edges[i] && (key->edges[i] <= t); i++) {
+        closed = !closed;
+    }
+    return closed;
+}
+
+/*
+ * key_down
+ *
+ * Return whether a key is down in the matrix
+ */
+static bool
+key_down(const key_test_t *key)
+{
+    uint16_t k = MATRIX_BIT(key->row, key->col);
+
+    return (matrix.word[k / 32] >> (k % 32)) & 1;
+}
+
+/*
+ * test_run
+ *
+ * Run one test, and report every commit that is missing, late or early.
+ * Returns the number of failures.
+ */
+static int
+test_run(const debounce_test_t *test)
+{
+    uint32_t raw[MATRIX_WORDS];
+    uint8_t commits[TEST_KEYS][TEST_EDGES];
+    uint8_t count[TEST_KEYS];
+    bool down[TEST_KEYS];
+    const key_test_t *key;
+    uint16_t k;
+    uint8_t t, i, w, n;
+    int failed = 0;
+
+    memset(&matrix, 0, sizeof(matrix));
+    memset(commits, 0, sizeof(commits));
+    memset(count, 0, sizeof(count));
+    memset(down, 0, sizeof(down));
+    debounce_init();
+    debounce_mode = test->mode;
+
+    for (t = 1; t < TEST_MS; t++) {
+        memset(raw, 0, sizeof(raw));
+        for (i = 0; i < TEST_KEYS; i++) {
+            key = &test->keys[i];
+            k = MATRIX_BIT(key->row, key->col);
+            if (key_raw(key, t)) {
+                raw[k / 32] |= (1U << (k % 32));
+            }
+        }
+
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            debounce_word(w, raw[w], t, true);
+        }
+
+        for (i = 0; i < TEST_KEYS; i++) {
+            if (key_down(&test->keys[i]) != down[i]) {
+                down[i] = !down[i];
+                if (count[i] < TEST_EDGES) {
+                    commits[i][count[i]++] = t;
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < TEST_KEYS; i++) {
+        key = &test->keys[i];
+        for (n = 0; n < TEST_EDGES; n++) {
+            if (commits[i][n] != key->commits[n]) {
+                printf("%s: key %d,%d commit %d at %d ms, expected %d ms\n",
+                       test->name, key->row, key->col, n, commits[i][n],
+                       key->commits[n]);
+                failed++;
+            }
+        }
+    }
+
+    return failed;
+}
+
+int
+main(void)
+{
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        failed += test_run(&tests[i]);
+    }
+
+    printf("debounce: %s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Debounce latency benchmark
+ *
+ * Runs random bouncing presses through debounce_word, the same way
+ * matrix_scan does, and shows for each debounce strategy how many ms pass
+ * between the first edge of a switch and the key being committed to the
+ * matrix. matrix_process queues a committed key in the same scan and
+ * keymap_process takes it in the same pass of the main loop, so this is the
+ * latency from press to keymap_event, to within one scan.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../config.h"
+#include "../debounce.h"
+#include "../matrix.h"
+
+#define LATENCY_RUNS        1000
+#define LATENCY_BOUNCE_MAX  5       /* ms a switch may bounce */
+#define LATENCY_HOLD        40      /* ms between press and release */
+
+matrix_t matrix;
+
+typedef struct {
+    uint32_t count;
+    uint32_t total;
+    uint32_t max;
+} latency_t;
+
+/*
+ * latency_add
+ *
+ * Account for one committed transition
+ */
+static void
+latency_add(latency_t *latency, uint32_t ms)
+{
+    latency->count++;
+    latency->total += ms;
+    if (ms > latency->max) {
+        latency->max = ms;
+    }
+}
+
+/*
+ * latency_bounce
+ *
+ * Fill in the ms at which a switch flips for one transition starting at
+ * start: an odd number of edges within LATENCY_BOUNCE_MAX ms. Returns the
+ * number of edges.
+ */
+static uint8_t
+latency_bounce(uint16_t *edges, uint16_t start)
+{
+    uint8_t n = 1 + 2 * (rand() % 3);
+    uint8_t i;
+
+    edges[0] = start;
+    for (i = 1; i < n; i++) {
+        edges[i] = edges[i - 1] + 1 + (rand() % 2);
+        if (edges[i] > start + LATENCY_BOUNCE_MAX) {
+            edges[i] = start + LATENCY_BOUNCE_MAX;
+        }
+    }
+    return n;
+}
+
+/*
+ * latency_run
+ *
+ * Measure press and release latency of a debounce strategy
+ */
+static void
+latency_run(const char *name, uint8_t mode)
+{
+    latency_t press, release;
+    uint16_t edges[16];
+    uint16_t i, t, first[2];
+    uint8_t n, e;
+    bool raw, down;
+
+    memset(&press, 0, sizeof(press));
+    memset(&release, 0, sizeof(release));
+    srand(1);
+
+    for (i = 0; i < LATENCY_RUNS; i++) {
+        memset(&matrix, 0, sizeof(matrix));
+        debounce_init();
+        debounce_mode = mode;
+
+        first[0] = 1;
+        first[1] = 1 + LATENCY_HOLD;
+        n = latency_bounce(edges, first[0]);
+        n += latency_bounce(edges + n, first[1]);
+
+        raw = down = false;
+        e = 0;
+        for (t = 1; t < first[1] + 2 * LATENCY_HOLD; t++) {
+            while ((e < n) && (edges[e] == t)) {
+                raw = !raw;
+                e++;
+            }
+            debounce_word(0, raw ? 1 : 0, t, true);
+            if ((matrix.word[0] & 1) != down) {
+                down = !down;
+                if (down) {
+                    latency_add(&press, t - first[0]);
+                } else {
+                    latency_add(&release, t - first[1]);
+                }
+            }
+        }
+    }
+
+    printf("%-6s press avg %u.%02u max %u ms, release avg %u.%02u max %u ms\n",
+           name,
+           press.total / press.count, (press.total * 100 / press.count) % 100,
+           press.max,
+           release.total / release.count,
+           (release.total * 100 / release.count) % 100,
+           release.max);
+}
+
+int
+main(void)
+{
+    printf("%d runs, bounce up to %d ms, window %d ms\n",
+           LATENCY_RUNS, LATENCY_BOUNCE_MAX, MS_DEBOUNCE);
+    latency_run("defer", DEBOUNCE_DEFER);
+    latency_run("eager", DEBOUNCE_EAGER);
+    return 0;
+}
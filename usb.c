@@ -37,7 +37,10 @@
  * - a cdc/acm usb serial port
  */
 
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/gpio.h>
@@ -48,12 +51,15 @@
 #include <libopencm3/usb/hid.h>
 #include <libopencm3/usb/usbd.h>
 
+#include "clock.h"
+#include "config.h"
 #include "descriptor.h"
 #include "elog.h"
 #include "extrakey.h"
 #include "hid.h"
 #include "keyboard.h"
 #include "mouse.h"
+#include "serial.h"
 #include "usb.h"
 #include "usb_keycode.h"
 
@@ -66,6 +72,96 @@ volatile uint8_t usb_ep_nkro_idle;
 volatile uint8_t usb_ep_extrakey_idle;
 volatile uint8_t usb_ep_serial_idle;
 
+/*
+ * Reconnecting, to let the host enumerate us again with new descriptors
+ */
+#define USB_RECONNECT_NONE                      0
+#define USB_RECONNECT_REQUESTED                 1
+#define USB_RECONNECT_DETACHED                  2
+
+static volatile uint8_t usb_reconnect;
+static uint32_t usb_reconnect_timer;
+
+#if (REPORT_FIFO_SIZE & (REPORT_FIFO_SIZE - 1)) != 0
+#error REPORT_FIFO_SIZE must be a power of two
+#endif
+
+/*
+ * HID report fifos, one per hid endpoint EP_KEYBOARD..EP_NKRO.
+ *
+ * Reports are not sent when they are made but at the next usb frame, so
+ * all changes between two frames go out as one report. The report for the
+ * coming frame is built in stage: a new report replaces it as long as it
+ * only changes modifier or nkro bits that the staged report left alone;
+ * on the mouse endpoint the movement is added up while the buttons stay
+ * the same. A report that would undo a change of the staged report, like
+ * the release of a key pressed in the same frame, or that changes a key
+ * slot or consumer code, pushes the staged report into the fifo first, so
+ * the host sees both.
+ *
+ * usb_sof sends the fifo, or else the staged report, when the endpoint is
+ * idle and the host read the report descriptor of its interface;
+ * usb_endpoint_idle keeps draining the fifo one poll interval apart.
+ * A report that equals the one before it is dropped, except on the mouse
+ * endpoint where reports carry relative movement. A full fifo replaces its
+ * newest report and counts an overflow, so the host always ends up with
+ * the latest state.
+ *
+ * When an endpoint has an idle rate, usb_sof sends the current report
+ * again once the endpoint has been quiet for that long; the mouse repeats
+ * only its buttons. An idle rate of 0 sends nothing but changes. The host
+ * sets the rates with SET_IDLE; until then the boot keyboard repeats every
+ * 500ms, as HID 1.11 7.2.4 asks.
+ *
+ * usb_update_* fill the stage from the main loop with interrupts off; the
+ * usb interrupt does the rest. usb_ep_*_idle are only set while nothing is
+ * staged, queued or in flight.
+ */
+#define REPORT_SIZE_MAX                         EP_SIZE_NKRO
+#define REPORT_FIFOS                            EP_NKRO
+
+typedef struct {
+    uint8_t report[REPORT_FIFO_SIZE][REPORT_SIZE_MAX];
+    uint8_t stage[REPORT_SIZE_MAX];
+    uint8_t last[REPORT_SIZE_MAX];
+    uint8_t head;
+    uint8_t tail;
+    uint8_t staged;
+    uint8_t busy;
+    uint16_t repeat;
+    uint16_t depth_max;
+    uint16_t coalesced;
+    uint16_t repeated;
+    uint16_t collapsed;
+    uint16_t overflow;
+} report_fifo_t;
+
+static report_fifo_t report_fifo[REPORT_FIFOS];
+
+static const uint8_t report_size[REPORT_FIFOS] = {
+    EP_SIZE_KEYBOARD, EP_SIZE_MOUSE, EP_SIZE_EXTRAKEY, EP_SIZE_NKRO
+};
+
+/* leading bytes of a report that are bit fields, the rest holds codes */
+static const uint8_t report_bits[REPORT_FIFOS] = {
+    offsetof(report_keyboard_t, keys), 0, 0, EP_SIZE_NKRO
+};
+
+static volatile uint8_t * const report_idle[REPORT_FIFOS] = {
+    &usb_ep_keyboard_idle, &usb_ep_mouse_idle,
+    &usb_ep_extrakey_idle, &usb_ep_nkro_idle
+};
+
+/* idle rates set by the host, in units of 4ms */
+static uint8_t * const report_rate[REPORT_FIFOS] = {
+    &keyboard_idle, &mouse_idle, &extrakey_idle, &nkro_idle
+};
+
+/* idle rates until the host sets them; 500ms for the boot keyboard */
+static const uint8_t report_rate_default[REPORT_FIFOS] = {
+    125, 0, 0, 0
+};
+
 /*
  * USB hid
  *
@@ -156,7 +252,7 @@ static const struct {
     }
 };
 
-const struct usb_endpoint_descriptor keyboard_endpoint = {
+struct usb_endpoint_descriptor keyboard_endpoint = {
     .bLength = USB_DT_ENDPOINT_SIZE,
     .bDescriptorType = USB_DT_ENDPOINT,
     .bEndpointAddress = USB_ENDPOINT_ADDR_IN(EP_KEYBOARD),
@@ -263,7 +359,7 @@ static const struct {
     }
 };
 
-const struct usb_endpoint_descriptor mouse_endpoint = {
+struct usb_endpoint_descriptor mouse_endpoint = {
     .bLength = USB_DT_ENDPOINT_SIZE,
     .bDescriptorType = USB_DT_ENDPOINT,
     .bEndpointAddress = USB_ENDPOINT_ADDR_IN(EP_MOUSE),
@@ -348,7 +444,7 @@ static const struct {
     }
 };
 
-const struct usb_endpoint_descriptor extrakey_endpoint = {
+struct usb_endpoint_descriptor extrakey_endpoint = {
     .bLength = USB_DT_ENDPOINT_SIZE,
     .bDescriptorType = USB_DT_ENDPOINT,
     .bEndpointAddress = USB_ENDPOINT_ADDR_IN(EP_EXTRAKEY),
@@ -458,7 +554,7 @@ static const struct {
     }
 };
 
-const struct usb_endpoint_descriptor nkro_endpoint = {
+struct usb_endpoint_descriptor nkro_endpoint = {
     .bLength = USB_DT_ENDPOINT_SIZE,
     .bDescriptorType = USB_DT_ENDPOINT,
     .bEndpointAddress = USB_ENDPOINT_ADDR_IN(EP_NKRO),
@@ -486,6 +582,27 @@ const struct usb_interface_descriptor nkro_iface = {
     .extralen = sizeof(nkro_function),
 };
 
+/*
+ * Polling profiles
+ *
+ * The bInterval in ms of the keyboard, mouse, extrakey and nkro endpoints.
+ * Compatible suits old hosts and BIOSes, fast polls every ms everywhere.
+ */
+uint32_t usb_poll;
+
+static const struct {
+    const char *name;
+    uint8_t interval[REPORT_FIFOS];
+} usb_poll_profiles[USB_POLL_NUM] = {
+    [USB_POLL_BALANCED]   = { "balanced",   { 10, 10, 10, 1 } },
+    [USB_POLL_COMPATIBLE] = { "compatible", { 10, 10, 10, 10 } },
+    [USB_POLL_FAST]       = { "fast",       { 1, 1, 1, 1 } },
+};
+
+static struct usb_endpoint_descriptor * const usb_poll_endpoints[REPORT_FIFOS] = {
+    &keyboard_endpoint, &mouse_endpoint, &extrakey_endpoint, &nkro_endpoint
+};
+
 /*
  * USB cdc acm
  *
@@ -816,48 +933,283 @@ usb_control_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf,
     return USBD_REQ_NEXT_CALLBACK;
 }
 
-static uint16_t
-usb_write_packet(usbd_device *dev, uint8_t addr, const void* buf, uint16_t len)
+/*
+ * usb_report_idle
+ *
+ * Tell the rest of the firmware whether anything is pending on a hid
+ * endpoint
+ */
+static void
+usb_report_idle(uint8_t i)
+{
+    report_fifo_t *fifo = &report_fifo[i];
+
+    *report_idle[i] = (!fifo->busy && !fifo->staged &&
+                       fifo->head == fifo->tail);
+}
+
+/*
+ * usb_report_reset
+ *
+ * Drop all waiting reports and go back to the default idle rates, i.e.
+ * when the host (re)configures us
+ */
+static void
+usb_report_reset(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < REPORT_FIFOS; i++) {
+        report_fifo[i].head = report_fifo[i].tail = 0;
+        report_fifo[i].staged = report_fifo[i].busy = 0;
+        report_fifo[i].repeat = 0;
+        *report_rate[i] = report_rate_default[i];
+        memset(report_fifo[i].last, 0, sizeof(report_fifo[i].last));
+        usb_report_idle(i);
+    }
+}
+
+/*
+ * usb_report_push
+ *
+ * Move the staged report of a hid endpoint into its fifo
+ */
+static void
+usb_report_push(uint8_t i)
+{
+    report_fifo_t *fifo = &report_fifo[i];
+    uint8_t depth = fifo->head - fifo->tail;
+
+    if (depth == REPORT_FIFO_SIZE) {
+        /* lose a transition rather than the latest state */
+        fifo->overflow++;
+        fifo->head--;
+    } else if (depth + 1 > fifo->depth_max) {
+        fifo->depth_max = depth + 1;
+    }
+    memcpy(fifo->report[fifo->head % REPORT_FIFO_SIZE], fifo->stage,
+           report_size[i]);
+    fifo->head++;
+    memcpy(fifo->last, fifo->stage, report_size[i]);
+    fifo->staged = 0;
+}
+
+/*
+ * usb_report_merge
+ *
+ * Fold a report into the staged report of a hid endpoint, returns false
+ * if that would hide a change of the staged report from the host
+ */
+static bool
+usb_report_merge(uint8_t ep, const uint8_t *report)
+{
+    report_fifo_t *fifo = &report_fifo[ep - EP_KEYBOARD];
+    report_mouse_t *stage = (report_mouse_t *)fifo->stage;
+    const report_mouse_t *mouse = (const report_mouse_t *)report;
+    int16_t x, y, v, h;
+    uint8_t i;
+
+    if (ep == EP_MOUSE) {
+        x = stage->x + mouse->x;
+        y = stage->y + mouse->y;
+        v = stage->v + mouse->v;
+        h = stage->h + mouse->h;
+        if (stage->buttons != mouse->buttons ||
+            x < INT8_MIN || x > INT8_MAX || y < INT8_MIN || y > INT8_MAX ||
+            v < INT8_MIN || v > INT8_MAX || h < INT8_MIN || h > INT8_MAX) {
+            return false;
+        }
+        stage->x = x;
+        stage->y = y;
+        stage->v = v;
+        stage->h = h;
+        return true;
+    }
+
+    for (i = 0; i < report_size[ep - EP_KEYBOARD]; i++) {
+        if (i >= report_bits[ep - EP_KEYBOARD]) {
+            /* a code replaced within a frame would never be seen */
+            if (report[i] != fifo->stage[i]) {
+                return false;
+            }
+        } else if ((fifo->stage[i] ^ fifo->last[i]) &
+                   (report[i] ^ fifo->stage[i])) {
+            return false;
+        }
+    }
+    memcpy(fifo->stage, report, report_size[ep - EP_KEYBOARD]);
+    return true;
+}
+
+/*
+ * usb_report
+ *
+ * Stage a report for the next usb frame on a hid endpoint
+ */
+static void
+usb_report(uint8_t ep, const void *report)
+{
+    report_fifo_t *fifo = &report_fifo[ep - EP_KEYBOARD];
+    uint8_t size = report_size[ep - EP_KEYBOARD];
+
+    cm_disable_interrupts();
+
+    if (fifo->staged && usb_report_merge(ep, report)) {
+        fifo->coalesced++;
+    } else if (!fifo->staged && ep != EP_MOUSE &&
+               !memcmp(fifo->last, report, size)) {
+        fifo->collapsed++;
+    } else {
+        if (fifo->staged) {
+            usb_report_push(ep - EP_KEYBOARD);
+        }
+        memcpy(fifo->stage, report, size);
+        fifo->staged = 1;
+    }
+    usb_report_idle(ep - EP_KEYBOARD);
+
+    cm_enable_interrupts();
+}
+
+/*
+ * usb_report_next
+ *
+ * Send the next report on an idle hid endpoint: the oldest one in its
+ * fifo, or at the start of a frame the staged one
+ */
+static void
+usb_report_next(uint8_t ep, bool frame)
+{
+    report_fifo_t *fifo = &report_fifo[ep - EP_KEYBOARD];
+    const uint8_t *report;
+
+    fifo->busy = 0;
+
+    if (fifo->head != fifo->tail) {
+        report = fifo->report[fifo->tail % REPORT_FIFO_SIZE];
+    } else if (frame && fifo->staged) {
+        report = fifo->stage;
+    } else {
+        usb_report_idle(ep - EP_KEYBOARD);
+        return;
+    }
+
+    if (usbd_ep_write_packet(usbd_dev, ep, report,
+                             report_size[ep - EP_KEYBOARD])) {
+        fifo->busy = 1;
+        fifo->repeat = *report_rate[ep - EP_KEYBOARD] * 4;
+        if (report == fifo->stage) {
+            memcpy(fifo->last, fifo->stage, report_size[ep - EP_KEYBOARD]);
+            fifo->staged = 0;
+        } else {
+            fifo->tail++;
+        }
+    }
+    usb_report_idle(ep - EP_KEYBOARD);
+}
+
+/*
+ * usb_report_repeat
+ *
+ * Send the current report of an idle hid endpoint again, as its idle rate
+ * expired
+ */
+static void
+usb_report_repeat(uint8_t ep)
 {
-    int tries = 0;
-    uint16_t wlen;
+    report_fifo_t *fifo = &report_fifo[ep - EP_KEYBOARD];
+    uint8_t report[REPORT_SIZE_MAX];
+    report_mouse_t *mouse = (report_mouse_t *)report;
 
-    for (wlen = usbd_ep_write_packet(dev, addr, buf, len);
-         (wlen == 0) && (tries < SEND_RETRIES);
-         tries++);
+    memcpy(report, fifo->last, report_size[ep - EP_KEYBOARD]);
+    if (ep == EP_MOUSE) {
+        mouse->x = mouse->y = mouse->v = mouse->h = 0;
+    }
 
-    if (wlen == 0) {
-        elog("could not send packet to %x", addr);
+    if (usbd_ep_write_packet(usbd_dev, ep, report,
+                             report_size[ep - EP_KEYBOARD])) {
+        fifo->busy = 1;
+        fifo->repeated++;
+        usb_report_idle(ep - EP_KEYBOARD);
+    }
+    fifo->repeat = *report_rate[ep - EP_KEYBOARD] * 4;
+}
+
+/*
+ * usb_report_frame
+ *
+ * A usb frame starts, send the reports collected since the last one, or
+ * repeat the current one when the idle rate asks for it
+ */
+static void
+usb_report_frame(void)
+{
+    report_fifo_t *fifo;
+    uint8_t ep;
+
+    for (ep = EP_KEYBOARD; ep <= EP_NKRO; ep++) {
+        fifo = &report_fifo[ep - EP_KEYBOARD];
+        if (!(usb_ifs_enumerated & (1 << (IF_KEYBOARD + ep - EP_KEYBOARD)))) {
+            /* the host is not ready for this interface yet */
+            continue;
+        }
+        if (fifo->repeat) {
+            fifo->repeat--;
+        }
+        if (!fifo->busy) {
+            usb_report_next(ep, true);
+        }
+        if (!fifo->busy && !fifo->repeat &&
+            *report_rate[ep - EP_KEYBOARD]) {
+            usb_report_repeat(ep);
+        }
     }
-    return wlen;
 }
 
 void
 usb_update_keyboard(report_keyboard_t *report)
 {
-    usb_ep_keyboard_idle = 0;
-    usb_write_packet(usbd_dev, EP_KEYBOARD, report->raw, EP_SIZE_KEYBOARD);
+    usb_report(EP_KEYBOARD, report->raw);
 }
 
 void
 usb_update_mouse(report_mouse_t *report)
 {
-    usb_ep_mouse_idle = 0;
-    usb_write_packet(usbd_dev, EP_MOUSE, &report->raw, EP_SIZE_MOUSE);
+    usb_report(EP_MOUSE, &report->raw);
 }
 
 void
 usb_update_extrakey(report_extrakey_t *report)
 {
-    usb_ep_extrakey_idle = 0;
-    usb_write_packet(usbd_dev, EP_EXTRAKEY, &report->raw, EP_SIZE_EXTRAKEY);
+    usb_report(EP_EXTRAKEY, &report->raw);
 }
 
 void
 usb_update_nkro(report_nkro_t *report)
 {
-    usb_ep_nkro_idle = 0;
-    usb_write_packet(usbd_dev, EP_NKRO, &report->raw, EP_SIZE_NKRO);
+    usb_report(EP_NKRO, &report->raw);
+}
+
+/*
+ * usb_stats
+ *
+ * Show the fill, coalesced, collapsed and repeated reports and overflows
+ * of the report fifos
+ */
+void
+usb_stats(void)
+{
+    report_fifo_t *fifo;
+    uint8_t i;
+
+    for (i = 0; i < REPORT_FIFOS; i++) {
+        fifo = &report_fifo[i];
+        printfnl("reports ep %d: %d/%d, max %d, coalesced %d, collapsed %d, "
+                 "repeated %d, overflows %d", i + EP_KEYBOARD,
+                 (uint8_t)(fifo->head - fifo->tail), REPORT_FIFO_SIZE,
+                 fifo->depth_max, fifo->coalesced, fifo->collapsed,
+                 fifo->repeated, fifo->overflow);
+    }
 }
 
 static void
@@ -865,6 +1217,8 @@ usb_set_config(usbd_device *dev, uint16_t wValue)
 {
     (void)wValue;
 
+    usb_report_reset();
+
     usbd_ep_setup(dev,
                   USB_ENDPOINT_ADDR_IN(EP_KEYBOARD),
                   USB_ENDPOINT_ATTR_INTERRUPT,
@@ -915,6 +1269,7 @@ static void
 usb_sof(void)
 {
     usb_ms++;
+    usb_report_frame();
 }
 
 uint32_t
@@ -926,6 +1281,80 @@ usb_now(void)
 /* Buffer used for control requests. */
 uint8_t usbd_control_buffer[256] __attribute__((aligned));
 
+/*
+ * usb_poll_dump
+ *
+ * Show the polling profiles and which one is in use
+ */
+void
+usb_poll_dump(void)
+{
+    uint8_t i, j;
+
+    for (i = 0; i < USB_POLL_NUM; i++) {
+        printf("%c%02x %s:", (i == usb_poll) ? '*' : ' ', i,
+               usb_poll_profiles[i].name);
+        for (j = 0; j < REPORT_FIFOS; j++) {
+            printf(" %d", usb_poll_profiles[i].interval[j]);
+        }
+        printfnl(" ms");
+    }
+}
+
+/*
+ * usb_poll_set
+ *
+ * Select a polling profile. The host only reads the intervals when it
+ * enumerates us, so when usb is up, reconnect once the answer to the
+ * command went out.
+ */
+void
+usb_poll_set(uint32_t profile)
+{
+    if (profile >= USB_POLL_NUM) {
+        elog("no poll profile %d", profile);
+        return;
+    }
+    if (profile == usb_poll) {
+        return;
+    }
+
+    usb_poll = profile;
+    if (usbd_dev) {
+        usb_reconnect_timer = timer_set(MS_RECONNECT);
+        usb_reconnect = USB_RECONNECT_REQUESTED;
+    }
+}
+
+/*
+ * usb_reconnect_run
+ *
+ * Step through a reconnect requested by usb_poll_set, from the main loop
+ */
+void
+usb_reconnect_run(void)
+{
+    switch (usb_reconnect) {
+        case USB_RECONNECT_REQUESTED:
+            if (timer_passed(usb_reconnect_timer)) {
+                nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+                nvic_disable_irq(NVIC_USB_WAKEUP_IRQ);
+                SET_REG(USB_CNTR_REG, USB_CNTR_FRES | USB_CNTR_PWDN);
+                usb_prevent_enumeration();
+                usb_reconnect_timer = timer_set(MS_RECONNECT);
+                usb_reconnect = USB_RECONNECT_DETACHED;
+            }
+            break;
+
+        case USB_RECONNECT_DETACHED:
+            if (timer_passed(usb_reconnect_timer)) {
+                usb_reconnect = USB_RECONNECT_NONE;
+                usb_init();
+            }
+            break;
+    }
+}
+
 void
 usb_prevent_enumeration(void)
 {
@@ -941,13 +1370,17 @@ usb_prevent_enumeration(void)
 void
 usb_init(void)
 {
+    uint8_t i;
+
     usb_ms = 0;
     usb_ifs_enumerated = 0;
     usb_ep_serial_idle = 0;
-    usb_ep_extrakey_idle = 1;
-    usb_ep_keyboard_idle = 1;
-    usb_ep_mouse_idle = 1;
-    usb_ep_nkro_idle = 1;
+    usb_report_reset();
+
+    for (i = 0; i < REPORT_FIFOS; i++) {
+        usb_poll_endpoints[i]->bInterval =
+            usb_poll_profiles[usb_poll].interval[i];
+    }
 
     usbd_dev = usbd_init(&st_usbfs_v1_usb_driver,
                          &dev_descriptor,
@@ -987,19 +1420,10 @@ usb_endpoint_idle(usbd_device *dev, uint8_t ep)
 
     switch (ep) {
         case EP_KEYBOARD:
-            usb_ep_keyboard_idle = 1;
-            break;
-
         case EP_MOUSE:
-            usb_ep_mouse_idle = 1;
-            break;
-
         case EP_NKRO:
-            usb_ep_nkro_idle = 1;
-            break;
-
         case EP_EXTRAKEY:
-            usb_ep_extrakey_idle = 1;
+            usb_report_next(ep, false);
             break;
 
         case EP_SERIALDATAIN:
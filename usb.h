@@ -89,8 +89,6 @@
 #define CDC_CONTROL_LINE_STATE_DTR              1
 #define CDC_CONTROL_LINE_STATE_RTS              2
 
-#define SEND_RETRIES                           10
-
 /*
  * STM32F1 requires data buffers to be at an 8 byte boundary. Ensure that
  * EP_SIZEs are aligned that way using this macro
@@ -134,8 +132,17 @@ typedef union {
     };
 } __attribute__ ((packed)) report_nkro_t;
 
+/*
+ * Polling profiles, see usb_poll_profiles
+ */
+#define USB_POLL_BALANCED                       0
+#define USB_POLL_COMPATIBLE                     1
+#define USB_POLL_FAST                           2
+#define USB_POLL_NUM                            3
+
 extern const char *usb_strings[];
 
+extern uint32_t usb_poll;
 extern volatile uint32_t usb_ms;
 extern volatile uint32_t usb_ifs_enumerated;
 extern volatile uint8_t usb_ep_keyboard_idle;
@@ -146,6 +153,9 @@ extern volatile uint8_t usb_ep_serial_idle;
 
 void usb_init(void);
 void usb_prevent_enumeration(void);
+void usb_poll_dump(void);
+void usb_poll_set(uint32_t profile);
+void usb_reconnect_run(void);
 uint32_t usb_now(void);
 
 void usb_enumeration_complete(void);
@@ -157,6 +167,7 @@ void usb_update_keyboard(report_keyboard_t *);
 void usb_update_mouse(report_mouse_t *);
 void usb_update_extrakey(report_extrakey_t *);
 void usb_update_nkro(report_nkro_t *);
+void usb_stats(void);
 
 void usb_endpoint_idle(usbd_device *dev, uint8_t ep);
 
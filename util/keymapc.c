@@ -0,0 +1,877 @@
+/*
+ * Copyright (c) 2026 by Willem Dijkstra <wpd@xs4all.nl>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the auhor nor the names of its contributors
+ *      may be used to endorse or promote products derived from this software
+ *      without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * keymapc
+ *
+ * Compile a keymap source into the default keymap tables of the firmware
+ * and into an image of the configuration flash, so a board can be set up
+ * in one write instead of one serial command per key. Key, consumer and
+ * system names are looked up in usb_keycode.h; anything unknown stops the
+ * build.
+ *
+ * usage: keymapc usb_keycode.h 5x5.keymap generated.h generated.bin
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../config.h"
+#include "../flash.h"
+#include "../keymap.h"
+#include "../leader.h"
+#include "../map_ascii.h"
+#include "../matrix.h"
+#include "../mouse.h"
+#include "../tapdance.h"
+
+#define LINE_MAX_LEN    512
+#define NAME_MAX_LEN    64
+#define SYMBOLS_MAX     1024
+#define ARGS_MAX        3
+
+typedef struct {
+    char name[NAME_MAX_LEN];
+    long value;
+} symbol_t;
+
+static symbol_t symbols[SYMBOLS_MAX];
+static int symbols_num;
+
+static const char *source_name;
+static int source_line;
+
+static flash_t image;
+static event_t layers[LAYERS_NUM][ROWS_NUM][COLS_NUM];
+
+/*
+ * fail
+ *
+ * Report an error in the keymap source and stop
+ */
+static void
+fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s:%d: error: ", source_name, source_line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/*
+ * symbol_add
+ *
+ * Remember the value of a name from usb_keycode.h
+ */
+static void
+symbol_add(const char *name, long value)
+{
+    if (symbols_num == SYMBOLS_MAX) {
+        fail("too many symbols");
+    }
+
+    snprintf(symbols[symbols_num].name, NAME_MAX_LEN, "%s", name);
+    symbols[symbols_num].value = value;
+    symbols_num++;
+}
+
+/*
+ * symbol_find
+ *
+ * Return the value of prefix followed by name, or stop if it is unknown
+ */
+static long
+symbol_find(const char *prefix, const char *name)
+{
+    char full[NAME_MAX_LEN];
+    int i;
+
+    snprintf(full, sizeof(full), "%s%s", prefix, name);
+    for (i = 0; i < symbols_num; i++) {
+        if (!strcmp(symbols[i].name, full)) {
+            return symbols[i].value;
+        }
+    }
+
+    fail("unknown name %s", full);
+    return 0;
+}
+
+/*
+ * symbols_read
+ *
+ * Collect the enumerators and MOD_ defines of usb_keycode.h. The enums
+ * there only use plain and hexadecimal values.
+ */
+static void
+symbols_read(const char *filename)
+{
+    char line[LINE_MAX_LEN];
+    char name[NAME_MAX_LEN];
+    char *p, *c;
+    long value = 0;
+    int in_enum = 0;
+    int in_comment = 0;
+    FILE *f;
+
+    source_name = filename;
+    source_line = 0;
+    if (!(f = fopen(filename, "r"))) {
+        fail("cannot open");
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        source_line++;
+
+        /* drop comments, which may span lines */
+        p = line;
+        while (*p) {
+            if (in_comment) {
+                if ((c = strstr(p, "*/"))) {
+                    memset(p, ' ', c + 2 - p);
+                    in_comment = 0;
+                } else {
+                    *p = 0;
+                }
+            } else if ((c = strstr(p, "/*"))) {
+                *c = ' ';
+                *(c + 1) = ' ';
+                p = c;
+                in_comment = 1;
+            } else {
+                break;
+            }
+        }
+
+        if (sscanf(line, " #define MOD_%63s", name) == 1) {
+            memmove(name + 4, name, strlen(name) + 1);
+            memcpy(name, "MOD_", 4);
+            symbol_add(name, strtol(line + strlen(" #define") +
+                                    strlen(name) + 1, 0, 0));
+            continue;
+        }
+        if (strstr(line, "enum ")) {
+            in_enum = 1;
+            value = 0;
+            continue;
+        }
+        if (!in_enum) {
+            continue;
+        }
+        if (strchr(line, '}')) {
+            in_enum = 0;
+            continue;
+        }
+
+        p = line;
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (!isalpha((unsigned char)*p) && (*p != '_')) {
+            continue;
+        }
+        c = name;
+        while ((isalnum((unsigned char)*p) || (*p == '_')) &&
+               (c < name + NAME_MAX_LEN - 1)) {
+            *c++ = *p++;
+        }
+        *c = 0;
+        if ((c = strchr(p, '='))) {
+            value = strtol(c + 1, 0, 0);
+        }
+        symbol_add(name, value++);
+    }
+
+    fclose(f);
+}
+
+/*
+ * number
+ *
+ * Parse a decimal or hexadecimal number within bounds
+ */
+static long
+number(const char *s, long min, long max)
+{
+    char *end;
+    long value = strtol(s, &end, 0);
+
+    if ((*s == 0) || (*end != 0)) {
+        fail("expected a number instead of '%s'", s);
+    }
+    if ((value < min) || (value > max)) {
+        fail("%ld out of range %ld..%ld", value, min, max);
+    }
+
+    return value;
+}
+
+/*
+ * modifiers
+ *
+ * Parse modifiers such as LSHIFT|LCTRL, or a number
+ */
+static uint8_t
+modifiers(char *s)
+{
+    uint8_t mods = 0;
+    char *m;
+
+    if (isdigit((unsigned char)*s)) {
+        return number(s, 0, 0xff);
+    }
+
+    for (m = strtok(s, "|"); m; m = strtok(0, "|")) {
+        mods |= symbol_find("MOD_", m);
+    }
+
+    return mods;
+}
+
+/*
+ * button
+ *
+ * Parse a mouse button as BUTTON1..BUTTON5, or a number of button bits
+ */
+static uint8_t
+button(const char *s)
+{
+    static const uint8_t buttons[] = {
+        MOUSE_BUTTON1, MOUSE_BUTTON2, MOUSE_BUTTON3,
+        MOUSE_BUTTON4, MOUSE_BUTTON5
+    };
+
+    if (!strncmp(s, "BUTTON", 6)) {
+        return buttons[number(s + 6, 1, 5) - 1];
+    }
+
+    return number(s, 0, 0xff);
+}
+
+/*
+ * policy
+ *
+ * Parse a tap-hold policy
+ */
+static uint8_t
+policy(const char *s)
+{
+    if (!strcmp(s, "TERM")) {
+        return TAPHOLD_TERM;
+    } else if (!strcmp(s, "PERMISSIVE")) {
+        return TAPHOLD_PERMISSIVE;
+    } else if (!strcmp(s, "OTHER")) {
+        return TAPHOLD_OTHER;
+    }
+
+    fail("unknown tap-hold policy %s", s);
+    return 0;
+}
+
+/*
+ * event_parse
+ *
+ * Parse one event such as KM(LSHIFT,A) at *s, and move *s past it
+ */
+static event_t
+event_parse(char **s)
+{
+    char name[NAME_MAX_LEN];
+    char *args[ARGS_MAX];
+    char *p = *s, *n = name;
+    event_t e;
+    int argc = 0;
+    int expect;
+
+    memset(&e, 0, sizeof(e));
+
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    while (isalnum((unsigned char)*p) && (n < name + NAME_MAX_LEN - 1)) {
+        *n++ = *p++;
+    }
+    *n = 0;
+    if (!*name) {
+        fail("expected an event at '%s'", p);
+    }
+
+    if (*p == '(') {
+        p++;
+        args[argc++] = p;
+        while (*p && (*p != ')')) {
+            if (*p == ',') {
+                if (argc == ARGS_MAX) {
+                    fail("too many arguments for %s", name);
+                }
+                *p = 0;
+                args[argc++] = p + 1;
+            } else if (isspace((unsigned char)*p)) {
+                memmove(p, p + 1, strlen(p));
+                continue;
+            }
+            p++;
+        }
+        if (*p != ')') {
+            fail("missing ) after %s", name);
+        }
+        *p++ = 0;
+    }
+    *s = p;
+
+    if (!strcmp(name, "NO")) {
+        expect = 0;
+        e.type = KMT_NONE;
+    } else if (!strcmp(name, "TR")) {
+        expect = 0;
+        e.type = KMT_TRANSPARENT;
+    } else if (!strcmp(name, "LD")) {
+        expect = 0;
+        e.type = KMT_LEADER;
+    } else if (!strcmp(name, "K")) {
+        expect = 1;
+        e.type = KMT_KEY;
+        e.key.code = symbol_find("KEY_", args[0]);
+    } else if (!strcmp(name, "KC")) {
+        expect = 1;
+        e.type = KMT_KEY;
+        e.key.code = strtol(args[0], 0, 16);
+    } else if (!strcmp(name, "KM") || !strcmp(name, "KMB")) {
+        expect = 2;
+        e.type = KMT_KEY;
+        e.key.code = symbol_find("KEY_", args[1]);
+        e.key.mod = modifiers(args[0]);
+    } else if (!strcmp(name, "S")) {
+        expect = 1;
+        e.type = KMT_KEY;
+        e.key.mod = modifiers(args[0]);
+    } else if (!strcmp(name, "C")) {
+        expect = 1;
+        e.type = KMT_CONSUMER;
+        e.extra.code = symbol_find("CONSUMER_", args[0]);
+    } else if (!strcmp(name, "Y")) {
+        expect = 1;
+        e.type = KMT_SYSTEM;
+        e.extra.code = symbol_find("SYSTEM_", args[0]);
+    } else if (!strcmp(name, "L") || !strcmp(name, "LM") || !strcmp(name, "LT")) {
+        expect = 1;
+        e.type = KMT_LAYER;
+        e.layer.mode = (name[1] == 'M') ? LAYER_MOMENTARY :
+            (name[1] == 'T') ? LAYER_TOGGLE : LAYER_DEFAULT;
+        e.layer.number = number(args[0], 0, LAYERS_NUM - 1);
+    } else if (!strcmp(name, "MT")) {
+        expect = 3;
+        e.type = KMT_TAPHOLD;
+        e.taphold.hold = modifiers(args[0]);
+        e.taphold.code = symbol_find("KEY_", args[1]);
+        e.taphold.mode = policy(args[2]);
+    } else if (!strcmp(name, "LH")) {
+        expect = 3;
+        e.type = KMT_TAPHOLD;
+        e.taphold.hold = number(args[0], 0, LAYERS_NUM - 1);
+        e.taphold.code = symbol_find("KEY_", args[1]);
+        e.taphold.mode = TAPHOLD_LAYER | policy(args[2]);
+    } else if (!strcmp(name, "OM")) {
+        expect = 1;
+        e.type = KMT_ONESHOT;
+        e.oneshot.mod = modifiers(args[0]);
+    } else if (!strcmp(name, "OL")) {
+        expect = 1;
+        e.type = KMT_ONESHOT;
+        e.oneshot.flags = ONESHOT_LAYER;
+        e.oneshot.layer = number(args[0], 0, LAYERS_NUM - 1);
+    } else if (!strcmp(name, "TD")) {
+        expect = 1;
+        e.type = KMT_TAPDANCE;
+        e.tapdance.number = number(args[0], 0, TAPDANCE_NUM - 1);
+    } else if (!strcmp(name, "MA")) {
+        expect = 1;
+        e.type = KMT_MACRO;
+        e.macro.number = number(args[0], 0, MACRO_MAXKEYS - 1);
+    } else if (!strcmp(name, "AM")) {
+        expect = 3;
+        e.type = KMT_AUTOMOUSE;
+        e.automouse.button = button(args[0]);
+        e.automouse.times = number(args[1], -128, 127);
+        e.automouse.wiggle = number(args[2], -128, 127);
+    } else if (!strcmp(name, "B")) {
+        expect = 1;
+        e.type = KMT_MOUSE;
+        e.mouse.button = button(args[0]);
+    } else if (!strcmp(name, "M")) {
+        expect = 2;
+        e.type = KMT_MOUSE;
+        e.mouse.x = number(args[0], -128, 127);
+        e.mouse.y = number(args[1], -128, 127);
+    } else if (!strcmp(name, "W")) {
+        expect = 2;
+        e.type = KMT_WHEEL;
+        e.wheel.h = number(args[0], -128, 127);
+        e.wheel.v = number(args[1], -128, 127);
+    } else {
+        fail("unknown event %s", name);
+        expect = 0;
+    }
+
+    if (argc != expect) {
+        fail("%s takes %d arguments", name, expect);
+    }
+
+    return e;
+}
+
+/*
+ * macro_parse
+ *
+ * Parse the quoted text of a macro key into events
+ */
+static void
+macro_parse(uint8_t n, char *p)
+{
+    event_t *e;
+    uint8_t len = 0;
+
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (*p++ != '"') {
+        fail("macro text must be quoted");
+    }
+
+    while (*p && (*p != '"')) {
+        if ((*p == '\\') && *(p + 1)) {
+            p++;
+        }
+        if (len == MACRO_MAXLEN - 2) {
+            fail("macro longer than %d characters", MACRO_MAXLEN - 2);
+        }
+        if (!(e = map_ascii_to_event(*p))) {
+            fail("cannot type character %02x", *p);
+        }
+        image.data.macro_buffer[n][len++] = *e;
+        p++;
+    }
+    if (*p != '"') {
+        fail("missing closing quote");
+    }
+
+    image.data.macro_len[n] = len;
+}
+
+/*
+ * combo_parse
+ *
+ * Parse the <row>,<column> keys of a combo and its event
+ */
+static void
+combo_parse(uint8_t n, char *p)
+{
+    combo_t *combo = &image.data.combos[n];
+    long r, c;
+    int keys = 0;
+    uint16_t k;
+    char *end;
+
+    while (*p && (*p != '=')) {
+        r = strtol(p, &end, 0);
+        if ((end == p) || (*end != ',')) {
+            if (isspace((unsigned char)*p)) {
+                p++;
+                continue;
+            }
+            fail("expected <row>,<column> at '%s'", p);
+        }
+        p = end + 1;
+        c = strtol(p, &end, 0);
+        if ((end == p) || (r < 0) || (r >= ROWS_NUM) || (c < 0) || (c >= COLS_NUM)) {
+            fail("combo key out of bounds");
+        }
+        p = end;
+        k = MATRIX_BIT(r, c);
+        combo->keys.word[k / 32] |= (1U << (k % 32));
+        keys++;
+    }
+    if ((keys < 2) || (keys > COMBO_MAXKEYS)) {
+        fail("combo needs 2 to %d keys", COMBO_MAXKEYS);
+    }
+    if (*p++ != '=') {
+        fail("missing = before the combo event");
+    }
+
+    combo->event = event_parse(&p);
+}
+
+/*
+ * override_parse
+ *
+ * Parse the key, trigger and optional suppress modifiers of an override
+ * and its event
+ */
+static void
+override_parse(uint8_t n, char *p)
+{
+    override_t *override = &image.data.overrides[n];
+    char key[NAME_MAX_LEN], trigger[NAME_MAX_LEN], suppress[NAME_MAX_LEN];
+    char *event = strchr(p, '=');
+    int fields;
+
+    if (!event) {
+        fail("missing = before the override event");
+    }
+    *event++ = 0;
+
+    fields = sscanf(p, "%63s %63s %63s", key, trigger, suppress);
+    if (fields < 2) {
+        fail("override needs a key and trigger");
+    }
+    override->key = symbol_find("KEY_", key);
+    override->trigger = modifiers(trigger);
+    if (fields == 3) {
+        override->suppress = modifiers(suppress);
+    }
+
+    override->event = event_parse(&event);
+}
+
+/*
+ * tapdance_parse
+ *
+ * Parse the actions of a tap-dance key, one per number of taps
+ */
+static void
+tapdance_parse(uint8_t n, char *p)
+{
+    tapdance_t *tapdance = &image.data.tapdances[n];
+    uint8_t taps = 0;
+
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (*p++ != '=') {
+        fail("missing = before the tap-dance actions");
+    }
+
+    while (1) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        if (taps == TAPDANCE_TAPS) {
+            fail("more than %d tap-dance actions", TAPDANCE_TAPS);
+        }
+        tapdance->tap[taps] = event_parse(&p);
+        if (tapdance->tap[taps].type == KMT_TAPDANCE) {
+            fail("tapdance cannot tap a tapdance");
+        }
+        taps++;
+    }
+}
+
+/*
+ * source_read
+ *
+ * Read the keymap source into the layers and the flash image
+ */
+static void
+source_read(const char *filename)
+{
+    char line[LINE_MAX_LEN];
+    char word[NAME_MAX_LEN];
+    char *p, *hash;
+    int layer = -1, row = ROWS_NUM, col, n, skip;
+    FILE *f;
+
+    source_name = filename;
+    source_line = 0;
+    if (!(f = fopen(filename, "r"))) {
+        fail("cannot open");
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        source_line++;
+        line[strcspn(line, "\r\n")] = 0;
+
+        if (sscanf(line, " macro %i %n", &n, &skip) == 1) {
+            if ((n < 0) || (n >= MACRO_MAXKEYS)) {
+                fail("macro number out of range");
+            }
+            macro_parse(n, line + skip);
+            continue;
+        }
+
+        if ((hash = strchr(line, '#'))) {
+            *hash = 0;
+        }
+        if (sscanf(line, " %63s", word) != 1) {
+            continue;
+        }
+
+        if (row < ROWS_NUM) {
+            /* a row of the current layer */
+            p = line;
+            for (col = 0; col < COLS_NUM; col++) {
+                layers[layer][row][col] = event_parse(&p);
+            }
+            while (isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (*p) {
+                fail("more than %d columns", COLS_NUM);
+            }
+            row++;
+        } else if (sscanf(line, " layer %i", &n) == 1) {
+            if ((n < 0) || (n >= LAYERS_NUM)) {
+                fail("layer out of range");
+            }
+            layer = n;
+            row = 0;
+        } else if (sscanf(line, " combo %i %n", &n, &skip) == 1) {
+            if ((n < 0) || (n >= COMBO_NUM)) {
+                fail("combo number out of range");
+            }
+            combo_parse(n, line + skip);
+        } else if (sscanf(line, " override %i %n", &n, &skip) == 1) {
+            if ((n < 0) || (n >= OVERRIDE_NUM)) {
+                fail("override number out of range");
+            }
+            override_parse(n, line + skip);
+        } else if (sscanf(line, " tapdance %i %n", &n, &skip) == 1) {
+            if ((n < 0) || (n >= TAPDANCE_NUM)) {
+                fail("tapdance number out of range");
+            }
+            tapdance_parse(n, line + skip);
+        } else if (sscanf(line, " default %i", &n) == 1) {
+            if ((n < 0) || (n >= LAYERS_NUM)) {
+                fail("layer out of range");
+            }
+            image.data.layer = n;
+        } else if (sscanf(line, " nkro %i", &n) == 1) {
+            image.data.nkro_active = !!n;
+        } else if (sscanf(line, " poll %i", &n) == 1) {
+            if ((n < 0) || (n >= USB_POLL_NUM)) {
+                fail("poll profile out of range");
+            }
+            image.data.usb_poll = n;
+        } else {
+            fail("unknown statement %s", word);
+        }
+    }
+    if (row < ROWS_NUM) {
+        fail("layer %d has only %d rows", layer, row);
+    }
+
+    fclose(f);
+}
+
+/*
+ * keymap_pack
+ *
+ * Store the layers sparse, as the firmware does: a present bit for every
+ * key that is not transparent and its cell, in layer and bit order.
+ */
+static void
+keymap_pack(void)
+{
+    uint16_t k, cells = 0;
+    uint8_t l, w;
+
+    for (l = 0; l < LAYERS_NUM; l++) {
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            for (k = w * 32; k < (w + 1) * 32; k++) {
+                if ((MATRIX_ROW(k) >= ROWS_NUM) || (MATRIX_COL(k) >= COLS_NUM) ||
+                    (layers[l][MATRIX_ROW(k)][MATRIX_COL(k)].type == KMT_TRANSPARENT)) {
+                    continue;
+                }
+                if (cells == KEYMAP_CELLS) {
+                    fail("keymap needs more than %d cells", KEYMAP_CELLS);
+                }
+                image.data.keymap_present[l].word[w] |= (1U << (k % 32));
+                image.data.keymap_cells[cells++] =
+                    layers[l][MATRIX_ROW(k)][MATRIX_COL(k)];
+            }
+        }
+    }
+}
+
+/*
+ * image_defaults
+ *
+ * Set what the source does not describe the way the firmware starts out:
+ * every key at the default debounce window, and no leader sequences.
+ */
+static void
+image_defaults(void)
+{
+    uint16_t n;
+    uint8_t r, c;
+
+    for (r = 0; r < ROWS_NUM; r++) {
+        for (c = 0; c < COLS_NUM; c++) {
+            image.data.debounce_ms[(r * COLS_NUM) + c] = MS_DEBOUNCE;
+        }
+    }
+
+    for (n = 0; n < LEADER_NODES; n++) {
+        image.data.leader_trie[n].base = LEADER_NONE;
+        image.data.leader_trie[n].check = LEADER_NONE;
+        image.data.leader_trie[n].event.type = KMT_NONE;
+    }
+    image.data.leader_trie[0].check = 0;
+}
+
+/*
+ * image_crc
+ *
+ * Calculate the crc over the configuration the way the STM32 crc unit
+ * does: CRC-32 polynomial on whole words, msb first, without reflection
+ * or final xor.
+ */
+static uint32_t
+image_crc(void)
+{
+    uint32_t crc = 0xffffffff;
+    uint32_t i;
+    uint8_t b;
+
+    for (i = 0; i < (sizeof(image.crc.data) >> 2); i++) {
+        crc ^= image.crc.data[i];
+        for (b = 0; b < 32; b++) {
+            crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04c11db7) : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/*
+ * header_write
+ *
+ * Emit the sparse keymap as the default tables of keymap.c
+ */
+static void
+header_write(const char *filename, const char *source)
+{
+    uint16_t i, cells = 0;
+    uint8_t l, w;
+    event_t *e;
+    FILE *f;
+
+    if (!(f = fopen(filename, "w"))) {
+        perror(filename);
+        exit(1);
+    }
+
+    for (l = 0; l < LAYERS_NUM; l++) {
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            cells += __builtin_popcount(image.data.keymap_present[l].word[w]);
+        }
+    }
+
+    fprintf(f, "/*\n * Generated by util/keymapc from %s, do not edit.\n */\n\n", source);
+    fprintf(f, "static const matrix_t keymap_base_present[LAYERS_NUM] =\n{\n");
+    for (l = 0; l < LAYERS_NUM; l++) {
+        fprintf(f, "    {{");
+        for (w = 0; w < MATRIX_WORDS; w++) {
+            fprintf(f, " 0x%08x%s", image.data.keymap_present[l].word[w],
+                    (w == MATRIX_WORDS - 1) ? " " : ",");
+        }
+        fprintf(f, "}},\n");
+    }
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "static const event_t keymap_base_cells[%d] =\n{\n", cells ? cells : 1);
+    for (i = 0; i < cells; i++) {
+        e = &image.data.keymap_cells[i];
+        fprintf(f, "    {.type = %d, .args = { 0x%02x, 0x%02x, 0x%02x }},\n",
+                e->type, e->args.num1, e->args.num2, e->args.num3);
+    }
+    fprintf(f, "};\n");
+
+    fclose(f);
+}
+
+/*
+ * image_write
+ *
+ * Emit the flash image, to be written at the start of user flash
+ */
+static void
+image_write(const char *filename)
+{
+    FILE *f;
+
+    if (!(f = fopen(filename, "wb"))) {
+        perror(filename);
+        exit(1);
+    }
+
+    image.crc.crc = image_crc();
+    if (fwrite(&image, sizeof(image), 1, f) != 1) {
+        perror(filename);
+        exit(1);
+    }
+
+    fclose(f);
+}
+
+int
+main(int argc, char **argv)
+{
+    uint8_t l, r, c;
+
+    if (argc != 5) {
+        fprintf(stderr, "usage: keymapc usb_keycode.h keymap header image\n");
+        return 1;
+    }
+
+    for (l = 0; l < LAYERS_NUM; l++) {
+        for (r = 0; r < ROWS_NUM; r++) {
+            for (c = 0; c < COLS_NUM; c++) {
+                layers[l][r][c].type = KMT_TRANSPARENT;
+            }
+        }
+    }
+
+    symbols_read(argv[1]);
+    image_defaults();
+    source_read(argv[2]);
+    keymap_pack();
+
+    header_write(argv[3], argv[2]);
+    image_write(argv[4]);
+
+    return 0;
+}